@@ -22,6 +22,9 @@
  *   - rio_readnb: removed redundant EINTR check
  */
 /* $begin csapp.c */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* splice() */
+#endif
 #include "csapp.h"
 
 /************************** 
@@ -793,6 +796,37 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+static long now_ms(void);
+
+/*
+ * rio_fill - read() into a rio buffer. If the rio has a deadline, first
+ *     wait for input until then and fail with ETIMEDOUT if none comes.
+ */
+static ssize_t rio_fill(rio_t *rp, void *buf, size_t n)
+{
+    struct pollfd pfd;
+    long left;
+    int rc;
+
+    if (rp->rio_deadline) {
+        pfd.fd = rp->rio_fd;
+        pfd.events = POLLIN;
+        do {
+            if ((left = rp->rio_deadline - now_ms()) <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        } while ((rc = poll(&pfd, 1, left)) < 0 && errno == EINTR);
+        if (rc < 0)
+            return -1;
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return read(rp->rio_fd, buf, n);
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -807,8 +841,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
     int cnt;
 
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
+	rp->rio_cnt = rio_fill(rp, rp->rio_buf, 
+			       sizeof(rp->rio_buf));
 	if (rp->rio_cnt < 0) {
 	    if (errno != EINTR) /* Interrupted by sig handler return */
 		return -1;
@@ -839,9 +873,20 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_deadline = 0;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_setdeadline - Make reads that need more input fail with ETIMEDOUT
+ *     once timeout_ms milliseconds have passed from now. A timeout <= 0
+ *     removes the deadline.
+ */
+void rio_setdeadline(rio_t *rp, int timeout_ms)
+{
+    rp->rio_deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -853,7 +898,18 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     char *bufp = usrbuf;
     
     while (nleft > 0) {
-	if ((nread = rio_read(rp, bufp, nleft)) < 0) 
+        if (rp->rio_cnt <= 0 && nleft >= sizeof(rp->rio_buf)) {
+            /* Internal buf is empty and the request is at least as
+               big: read straight into the user buf, skipping a copy */
+            if ((nread = rio_fill(rp, bufp, nleft)) < 0) {
+                if (errno != EINTR)
+                    return -1;  /* errno set by read() */
+                nread = 0;      /* Interrupted, call read() again */
+            }
+            else if (nread == 0)
+                break;          /* EOF */
+        }
+	else if ((nread = rio_read(rp, bufp, nleft)) < 0) 
             return -1;          /* errno set by read() */ 
 	else if (nread == 0)
 	    break;              /* EOF */
@@ -864,35 +920,207 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes (buffered), blocking only until
+ *     some are available. Used to relay a body as it arrives rather
+ *     than in full blocks of n.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt > 0 || n < sizeof(rp->rio_buf))
+        return rio_read(rp, usrbuf, n);
+    /* Internal buf is empty and the request is at least as big */
+    while ((nread = rio_fill(rp, usrbuf, n)) < 0)
+        if (errno != EINTR)
+            return -1;  /* errno set by read() */
+    return nread;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *
+ *     Instead of pulling one byte at a time through rio_read, search
+ *     the internal buffer for the newline with memchr and copy the
+ *     whole run at once. At most maxlen-1 bytes are stored, same as
+ *     the byte-at-a-time version.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *nl = NULL;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
+    while (n + 1 < maxlen) { 
+        while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+            rp->rio_cnt = rio_fill(rp, rp->rio_buf, sizeof(rp->rio_buf));
+            if (rp->rio_cnt < 0) {
+                if (errno != EINTR) /* Interrupted by sig handler return */
+                    return -1;      /* Error */
             }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+            else if (rp->rio_cnt == 0) { /* EOF */
+                if (n == 0)
+                    return 0;       /* EOF, no data read */
+                goto done;          /* EOF, some data was read */
+            }
+            else 
+                rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+        }
+
+        /* Copy up to and including the newline, or as much as fits */
+        cnt = rp->rio_cnt;
+        if (cnt > maxlen - 1 - n)
+            cnt = maxlen - 1 - n;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
+        if (nl)
+            break;
     }
+ done:
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_splice - Move n bytes from infd to outfd without copying them
+ *     into user space, or until EOF if n < 0 (unbuffered). The data
+ *     goes through a per-thread pipe with splice(), which is closed
+ *     when the thread exits. If the descriptors don't support splice(),
+ *     falls back to a read/write copy.
+ *     Returns the number of bytes moved, or -1 on error.
+ */
+#define RIO_SPLICE_CHUNK 65536
+static __thread int rio_pipefd[2] = {-1, -1};
+static pthread_key_t rio_pipe_key;
+static pthread_once_t rio_pipe_once = PTHREAD_ONCE_INIT;
+
+/* Key destructor: close the exiting thread's pipe */
+static void rio_pipe_close(void *vargp)
+{
+    int *fd = vargp;
+
+    if (fd[0] >= 0) {
+        close(fd[0]);
+        close(fd[1]);
+        fd[0] = fd[1] = -1;
+    }
+}
+
+static void rio_pipe_init(void)
+{
+    pthread_key_create(&rio_pipe_key, rio_pipe_close);
+}
+
+/* Create this thread's pipe and register it for closing at thread exit */
+static int rio_pipe_open(void)
+{
+    pthread_once(&rio_pipe_once, rio_pipe_init);
+    if (pipe(rio_pipefd) < 0)
+        return -1;
+    pthread_setspecific(rio_pipe_key, rio_pipefd);
+    return 0;
+}
+
+static ssize_t rio_copy(int infd, int outfd, ssize_t n)
+{
+    char buf[RIO_SPLICE_CHUNK];
+    ssize_t total = 0, nread;
+    size_t want;
+
+    while (n < 0 || total < n) {
+        want = sizeof(buf);
+        if (n >= 0 && (size_t)(n - total) < want)
+            want = n - total;
+        if ((nread = read(infd, buf, want)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (nread == 0)
+            break;              /* EOF */
+        if (rio_writen(outfd, buf, nread) != nread)
+            return -1;
+        total += nread;
+    }
+    return total;
+}
+
+ssize_t rio_splice(int infd, int outfd, ssize_t n) 
+{
+    ssize_t total = 0, nin, nout;
+    size_t want, inpipe;
+    unsigned int flags;
+
+    if (rio_pipefd[0] < 0 && rio_pipe_open() < 0)
+        return rio_copy(infd, outfd, n);
+
+    while (n < 0 || total < n) {
+        want = RIO_SPLICE_CHUNK;
+        if (n >= 0 && (size_t)(n - total) < want)
+            want = n - total;
+        if ((nin = splice(infd, NULL, rio_pipefd[1], NULL, want, SPLICE_F_MOVE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && total == 0)
+                return rio_copy(infd, outfd, n); /* Not spliceable */
+            return -1;
+        }
+        if (nin == 0)
+            break;              /* EOF */
+
+        /* Drain the pipe completely so the next call starts empty */
+        flags = SPLICE_F_MOVE;
+        if (n < 0 || total + nin < n)
+            flags |= SPLICE_F_MORE;
+        for (inpipe = nin; inpipe > 0; inpipe -= nout) {
+            if ((nout = splice(rio_pipefd[0], NULL, outfd, NULL, inpipe, flags)) <= 0) {
+                if (nout < 0 && errno == EINTR) {
+                    nout = 0;
+                    continue;
+                }
+                /* Data stuck in the pipe would leak into the next call */
+                close(rio_pipefd[0]);
+                close(rio_pipefd[1]);
+                rio_pipefd[0] = rio_pipefd[1] = -1;
+                return -1;
+            }
+        }
+        total += nin;
+    }
+    return total;
+}
+
+/*
+ * rio_splicenb - Move n bytes (or until EOF if n < 0) from rp to outfd
+ *     (buffered). Bytes already sitting in rp's internal buffer are
+ *     written first, the rest is moved with rio_splice.
+ */
+ssize_t rio_splicenb(rio_t *rp, int outfd, ssize_t n) 
+{
+    ssize_t cnt = rp->rio_cnt, rc;
+
+    if (n >= 0 && cnt > n)
+        cnt = n;
+    if (cnt > 0) {
+        if (rio_writen(outfd, rp->rio_bufptr, cnt) != cnt)
+            return -1;
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        if (n >= 0 && (n -= cnt) == 0)
+            return cnt;
+    }
+    if ((rc = rio_splice(rp->rio_fd, outfd, n)) < 0)
+        return -1;
+    return cnt + rc;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -925,6 +1153,15 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0)
+	unix_error("Rio_readsomeb error");
+    return rc;
+}
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
     ssize_t rc;
@@ -934,9 +1171,405 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_splice(int infd, int outfd, ssize_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_splice(infd, outfd, n)) < 0)
+	unix_error("Rio_splice error");
+    return rc;
+}
+
+ssize_t Rio_splicenb(rio_t *rp, int outfd, ssize_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_splicenb(rp, outfd, n)) < 0)
+	unix_error("Rio_splicenb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
+/*
+ * DNS resolution cache in front of getaddrinfo. Results are kept per
+ * <hostname, port> for DNS_CACHE_TTL seconds, failures for
+ * DNS_NEGATIVE_TTL seconds. When several threads miss on the same key
+ * at once, only the first one calls getaddrinfo and the rest wait for
+ * its result. Numeric addresses and localhost never reach the resolver.
+ */
+/* $begin dnscache */
+#define DNS_CACHE_TTL     60   /* Seconds to keep a successful lookup */
+#define DNS_NEGATIVE_TTL  5    /* Seconds to keep a failed lookup */
+#define DNS_CACHE_MAX     1024 /* Max number of cached keys */
+#define DNS_NBUCKETS      256
+
+typedef struct dns_entry {
+    char key[MAXLINE];          /* "hostname:port" */
+    struct addrinfo *res;       /* Private copy of the getaddrinfo list */
+    int rc;                     /* getaddrinfo return code; nonzero is a negative entry */
+    time_t expires;
+    int pending;                /* A thread is resolving this key */
+    struct dns_entry *next;
+} dns_entry_t;
+
+static struct {
+    dns_entry_t *buckets[DNS_NBUCKETS];
+    int nentries;
+    pthread_mutex_t mutex;
+    pthread_cond_t resolved;    /* Signaled when a pending lookup finishes */
+    dns_stats_t stats;
+} dns_cache = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .resolved = PTHREAD_COND_INITIALIZER,
+};
+
+/* Copy an addrinfo list into a single malloc'd block that is released
+   with dns_freeaddrinfo (plain free) */
+static struct addrinfo *dns_copy(struct addrinfo *list)
+{
+    struct addrinfo *p, *copy, *q;
+    struct sockaddr_storage *addrs;
+    int n = 0;
+
+    for (p = list; p; p = p->ai_next)
+        n++;
+    if (n == 0)
+        return NULL;
+    if ((copy = malloc(n * (sizeof(struct addrinfo) + sizeof(struct sockaddr_storage)))) == NULL)
+        return NULL;
+    addrs = (struct sockaddr_storage *)(copy + n);
+    for (p = list, q = copy; p; p = p->ai_next, q++, addrs++) {
+        *q = *p;
+        memcpy(addrs, p->ai_addr, p->ai_addrlen);
+        q->ai_addr = (struct sockaddr *)addrs;
+        q->ai_canonname = NULL;
+        q->ai_next = p->ai_next ? q + 1 : NULL;
+    }
+    return copy;
+}
+
+/* Drop expired entries; if the table is still full, drop the entry
+   closest to expiring. Caller holds dns_cache.mutex */
+static void dns_evict(time_t now)
+{
+    dns_entry_t **pp, *e, **victim = NULL;
+    int i;
+
+    for (i = 0; i < DNS_NBUCKETS; i++) {
+        pp = &dns_cache.buckets[i];
+        while ((e = *pp) != NULL) {
+            if (!e->pending && e->expires <= now) {
+                *pp = e->next;
+                free(e->res);
+                free(e);
+                dns_cache.nentries--;
+                continue;
+            }
+            if (!e->pending && (!victim || e->expires < (*victim)->expires))
+                victim = pp;
+            pp = &e->next;
+        }
+    }
+    if (dns_cache.nentries >= DNS_CACHE_MAX && victim) {
+        e = *victim;
+        *victim = e->next;
+        free(e->res);
+        free(e);
+        dns_cache.nentries--;
+    }
+}
+
+/*
+ * dns_lookup - Shared body of dns_getaddrinfo and dns_trygetaddrinfo.
+ *     If wait is zero, a miss or a lookup already in progress returns
+ *     DNS_WOULDBLOCK instead of calling or waiting for the resolver.
+ */
+static int dns_lookup(char *hostname, char *port, struct addrinfo **result, int wait)
+{
+    struct addrinfo hints, *listp;
+    unsigned char addr[sizeof(struct in6_addr)];
+    char key[MAXLINE];
+    unsigned int h = 5381;
+    dns_entry_t *e;
+    time_t now;
+    char *s;
+    int rc, waited = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
+
+    /* Fast path: numeric addresses are converted without the resolver,
+       and a NULL node yields the loopback addresses */
+    if (inet_pton(AF_INET, hostname, addr) == 1 || inet_pton(AF_INET6, hostname, addr) == 1
+            || !strcasecmp(hostname, "localhost")) {
+        if (strcasecmp(hostname, "localhost"))
+            hints.ai_flags |= AI_NUMERICHOST;
+        else
+            hostname = NULL;
+        if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0)
+            return rc;
+        *result = dns_copy(listp);
+        freeaddrinfo(listp);
+        pthread_mutex_lock(&dns_cache.mutex);
+        dns_cache.stats.numeric++;
+        pthread_mutex_unlock(&dns_cache.mutex);
+        return *result ? 0 : EAI_MEMORY;
+    }
+    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    for (s = key; *s; s++)
+        h = h * 33 + (unsigned char)tolower(*s);
+    h %= DNS_NBUCKETS;
+
+    pthread_mutex_lock(&dns_cache.mutex);
+    while (1) {
+        now = time(NULL);
+        for (e = dns_cache.buckets[h]; e; e = e->next)
+            if (!strcasecmp(e->key, key))
+                break;
+        if (e && e->pending) {
+            /* Someone else is already resolving this key */
+            if (!wait)
+                break;
+            if (!waited++)
+                dns_cache.stats.coalesced++;
+            pthread_cond_wait(&dns_cache.resolved, &dns_cache.mutex);
+            continue;
+        }
+        if (e && e->expires > now) {
+            if (e->rc == 0) {
+                dns_cache.stats.hits++;
+                *result = dns_copy(e->res);
+                rc = *result ? 0 : EAI_MEMORY;
+            }
+            else {
+                dns_cache.stats.negative_hits++;
+                rc = e->rc;
+            }
+            pthread_mutex_unlock(&dns_cache.mutex);
+            return rc;
+        }
+        break;
+    }
+
+    if (!wait) {
+        pthread_mutex_unlock(&dns_cache.mutex);
+        return DNS_WOULDBLOCK;
+    }
+
+    /* Miss or expired: claim the key and resolve without holding the lock */
+    if (!e) {
+        if (dns_cache.nentries >= DNS_CACHE_MAX)
+            dns_evict(now);
+        if ((e = calloc(1, sizeof(dns_entry_t))) == NULL) {
+            pthread_mutex_unlock(&dns_cache.mutex);
+            return EAI_MEMORY;
+        }
+        strcpy(e->key, key);
+        e->next = dns_cache.buckets[h];
+        dns_cache.buckets[h] = e;
+        dns_cache.nentries++;
+    }
+    e->pending = 1;
+    dns_cache.stats.misses++;
+    pthread_mutex_unlock(&dns_cache.mutex);
+
+    rc = getaddrinfo(hostname, port, &hints, &listp);
+
+    pthread_mutex_lock(&dns_cache.mutex);
+    free(e->res);
+    e->res = NULL;
+    if (rc == 0) {
+        e->res = dns_copy(listp);
+        freeaddrinfo(listp);
+        if (e->res == NULL)
+            rc = EAI_MEMORY;
+    }
+    /* Transient resolver failures are not cached */
+    e->rc = rc;
+    e->expires = time(NULL) + (rc == 0 ? DNS_CACHE_TTL : (rc == EAI_AGAIN || rc == EAI_MEMORY) ? 0 : DNS_NEGATIVE_TTL);
+    e->pending = 0;
+    *result = rc == 0 ? dns_copy(e->res) : NULL;
+    if (rc == 0 && *result == NULL)
+        rc = EAI_MEMORY;
+    pthread_cond_broadcast(&dns_cache.resolved);
+    pthread_mutex_unlock(&dns_cache.mutex);
+    return rc;
+}
+
+/*
+ * dns_getaddrinfo - getaddrinfo(hostname, port) for a TCP connection,
+ *     served from the cache when possible. Returns 0 and a list in
+ *     *result that must be released with dns_freeaddrinfo, or a
+ *     getaddrinfo error code.
+ */
+int dns_getaddrinfo(char *hostname, char *port, struct addrinfo **result)
+{
+    return dns_lookup(hostname, port, result, 1);
+}
+
+/*
+ * dns_trygetaddrinfo - Like dns_getaddrinfo, but never blocks: numeric
+ *     addresses and cached answers are returned as usual, anything
+ *     that needs the resolver returns DNS_WOULDBLOCK.
+ */
+int dns_trygetaddrinfo(char *hostname, char *port, struct addrinfo **result)
+{
+    return dns_lookup(hostname, port, result, 0);
+}
+
+void dns_freeaddrinfo(struct addrinfo *list)
+{
+    free(list);
+}
+
+/* Copy the cache counters into *st */
+void dns_cache_stats(dns_stats_t *st)
+{
+    pthread_mutex_lock(&dns_cache.mutex);
+    *st = dns_cache.stats;
+    pthread_mutex_unlock(&dns_cache.mutex);
+}
+/* $end dnscache */
+
+/*
+ * Connection attempts in open_clientfd are non-blocking and overlap
+ * (Happy Eyeballs, RFC 8305): the addresses are ordered so the two
+ * families alternate, a new attempt starts every connect_stagger_ms
+ * (or immediately once all running attempts have failed), and each
+ * attempt is abandoned after connect_timeout_ms. The first socket that
+ * connects wins and the others are closed.
+ */
+#define CONNECT_MAX_ADDRS 16
+
+static int connect_stagger_ms = 250;   /* Delay before trying the next address */
+static int connect_timeout_ms = 3000;  /* Deadline for a single attempt */
+
+/* Change the stagger delay and per-attempt deadline; a value <= 0 keeps
+   the current setting. Call before starting any threads. */
+void open_clientfd_timeouts(int stagger_ms, int timeout_ms)
+{
+    if (stagger_ms > 0)
+        connect_stagger_ms = stagger_ms;
+    if (timeout_ms > 0)
+        connect_timeout_ms = timeout_ms;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Race connections to the addresses in listp. Returns a connected
+   blocking socket, or -1 with errno set from the last failure. */
+static int connect_eyeballs(struct addrinfo *listp)
+{
+    struct addrinfo *addrs[CONNECT_MAX_ADDRS], *p, *q;
+    struct pollfd pfd[CONNECT_MAX_ADDRS];
+    long deadline[CONNECT_MAX_ADDRS], now, next_start, wait;
+    int naddrs = 0, next = 0, nfds = 0, i, fd = -1, err, lasterr = ECONNREFUSED;
+    socklen_t len;
+
+    /* Interleave the family of the first result with the other family */
+    p = listp;
+    q = listp;
+    while ((p || q) && naddrs < CONNECT_MAX_ADDRS) {
+        while (p && p->ai_family != listp->ai_family)
+            p = p->ai_next;
+        if (p) {
+            addrs[naddrs++] = p;
+            p = p->ai_next;
+        }
+        while (q && q->ai_family == listp->ai_family)
+            q = q->ai_next;
+        if (q && naddrs < CONNECT_MAX_ADDRS) {
+            addrs[naddrs++] = q;
+            q = q->ai_next;
+        }
+    }
+
+    next_start = now_ms();
+    while (next < naddrs || nfds > 0) {
+        now = now_ms();
+
+        /* Start the next attempt when its turn comes, or right away if
+           nothing is in flight */
+        if (next < naddrs && (now >= next_start || nfds == 0)) {
+            p = addrs[next++];
+            next_start = now + connect_stagger_ms;
+            if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+                lasterr = errno;
+                continue; /* Socket failed, try the next */
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+                goto connected;
+            if (errno != EINPROGRESS) {
+                lasterr = errno;
+                close(fd);
+                continue;
+            }
+            pfd[nfds].fd = fd;
+            pfd[nfds].events = POLLOUT;
+            deadline[nfds] = now + connect_timeout_ms;
+            nfds++;
+            continue;
+        }
+
+        /* Wait for an attempt to finish, its deadline, or the next start */
+        wait = next < naddrs ? next_start - now : connect_timeout_ms;
+        for (i = 0; i < nfds; i++)
+            if (deadline[i] - now < wait)
+                wait = deadline[i] - now;
+        if (poll(pfd, nfds, wait > 0 ? wait : 0) < 0 && errno != EINTR) {
+            lasterr = errno;
+            break;
+        }
+        now = now_ms();
+        for (i = 0; i < nfds; ) {
+            if (pfd[i].revents) {
+                len = sizeof(err);
+                if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                    err = errno;
+                if (err == 0) {
+                    fd = pfd[i].fd;
+                    pfd[i] = pfd[--nfds];
+                    goto connected;
+                }
+                lasterr = err;
+            }
+            else if (now >= deadline[i])
+                lasterr = ETIMEDOUT;
+            else {
+                i++;
+                continue;
+            }
+            close(pfd[i].fd);
+            pfd[i] = pfd[nfds - 1];
+            deadline[i] = deadline[--nfds];
+        }
+    }
+
+    /* Abandon the attempts still in flight */
+    for (i = 0; i < nfds; i++)
+        close(pfd[i].fd);
+    errno = lasterr;
+    return -1;
+
+ connected:
+    for (i = 0; i < nfds; i++)
+        close(pfd[i].fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
@@ -949,39 +1582,22 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo *listp;
 
     /* Get a list of potential server addresses */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
-    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
-    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+    if ((rc = dns_getaddrinfo(hostname, port, &listp)) != 0) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
   
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
-
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+    /* Race the addresses for one that we can successfully connect to */
+    clientfd = connect_eyeballs(listp);
 
     /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
-        return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    rc = errno;
+    dns_freeaddrinfo(listp);
+    errno = rc;
+    return clientfd;
 }
 /* $end open_clientfd */
 
@@ -994,7 +1610,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opts(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1635,14 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let several sockets bind the same port; the kernel spreads
+           incoming connections across them */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1665,21 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) 
+{
+    return open_listenfd_opts(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Same as open_listenfd, but the socket is
+ *     created with SO_REUSEPORT so that one listener per thread can be
+ *     bound to the same port.
+ */
+int open_listenfd_reuseport(char *port) 
+{
+    return open_listenfd_opts(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1703,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
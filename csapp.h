@@ -15,6 +15,8 @@
 #include <signal.h>
 #include <dirent.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -47,6 +49,7 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
+    long rio_deadline;         /* Reads fail with ETIMEDOUT after this (ms), 0 = none */
     char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
 } rio_t;
 /* $end rio_t */
@@ -60,6 +63,11 @@ extern char **environ; /* Defined by libc */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
 
+/* glibc declares an unrelated gai_error() when _GNU_SOURCE is defined */
+#ifdef _GNU_SOURCE
+#define gai_error csapp_gai_error
+#endif
+
 /* Our own error-handling functions */
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
@@ -176,23 +184,49 @@ void V(sem_t *sem);
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_setdeadline(rio_t *rp, int timeout_ms);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_splice(int infd, int outfd, ssize_t n);
+ssize_t rio_splicenb(rio_t *rp, int outfd, ssize_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_splice(int infd, int outfd, ssize_t n);
+ssize_t Rio_splicenb(rio_t *rp, int outfd, ssize_t n);
+
+/* DNS resolution cache used by open_clientfd */
+typedef struct {
+    unsigned long hits;          /* Served from a cached lookup */
+    unsigned long negative_hits; /* Served from a cached failure */
+    unsigned long misses;        /* Called getaddrinfo */
+    unsigned long coalesced;     /* Waited for another thread's lookup */
+    unsigned long numeric;       /* Numeric host or localhost, no lookup */
+} dns_stats_t;
+
+#define DNS_WOULDBLOCK 1 /* dns_trygetaddrinfo needs the resolver (EAI_* codes are negative) */
+
+int dns_getaddrinfo(char *hostname, char *port, struct addrinfo **result);
+int dns_trygetaddrinfo(char *hostname, char *port, struct addrinfo **result);
+void dns_freeaddrinfo(struct addrinfo *list);
+void dns_cache_stats(dns_stats_t *st);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+void open_clientfd_timeouts(int stagger_ms, int timeout_ms);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
 
 
 #endif /* __CSAPP_H__ */
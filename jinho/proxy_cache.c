@@ -1,269 +1,4876 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include "csapp.h"
 
-void cache_init();
-void *thread_routine(void *connfdp);
-void doit(int connfd);
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define DISK_CACHE_SIZE (256 * 1024 * 1024) // -d로 켜는 디스크 캐시 파일 크기
+
+// 슬랩 할당기. 캐시 용량만큼의 메모리를 페이지(보통 SLAB_PAGE_SIZE)로 나눠 두고, 페이지는 크기 클래스 하나에 배정되어
+// 그 클래스의 chunk 크기로 잘려 쓰임. 항목은 자기 크기가 들어가는 가장 작은 클래스의 chunk 하나를 차지함
+#define SLAB_PAGE_SIZE (128 * 1024) // 가장 큰 항목(구조체 + MAX_OBJECT_SIZE + MAXLINE)이 들어가는 크기
+#define SLAB_MIN_PAGES 2            // 용량이 이만큼의 페이지가 안 되는 작은 캐시(샤드 모드)는 페이지 크기를 절반씩 줄임
+#define SLAB_MIN_PAGE_SIZE (32 * 1024)
+#define SLAB_MIN_CHUNK 256          // 가장 작은 클래스의 chunk 크기
+#define SLAB_GROWTH 1.25            // 다음 클래스의 chunk 크기 비율
+#define SLAB_MAX_CLASSES 64
+
+// 캐시 샤드 수. 2의 거듭제곱이며, 항목은 uri 해시의 상위 비트로 샤드를 고름
+#define CACHE_SHARDS 16
+
+// 차출 정책. 샤드의 클래스마다 있는 영역(cache_region)에서 어떤 항목을 차출할지 정하며, -P 옵션으로 고름
+#define POLICY_LRU 0    // 히트할 때마다 리스트 앞으로 옮김. 샤드 잠금을 바로 얻지 못한 히트는 차출할 차례에 옮김
+#define POLICY_CLOCK 1  // 히트는 referenced만 남기고, 차출할 차례에 한 번 더 남겨 둠 (기본값)
+#define POLICY_S3FIFO 2 // 작은 FIFO와 본 FIFO, 차출한 uri의 ghost
+#define POLICY_ARC 3    // 한 번 쓰인 항목(T1)과 두 번 이상 쓰인 항목(T2), 두 리스트의 ghost로 T1의 몫을 조절함. 히트는 LRU처럼 옮김
+#define POLICY_COUNT 4
+#define S3FIFO_SMALL_PCT 10 // S3-FIFO에서 작은 FIFO에 두는 항목 비율(%)
+#define S3FIFO_FREQ_MAX 3   // S3-FIFO의 항목별 히트 수 상한
+
+// W-TinyLFU 입장 제어. 새 항목은 샤드의 영역마다 있는 작은 윈도 LRU 리스트에 먼저 들어가고, 윈도에서 밀려나는 항목은
+// 차출 정책이 고른 희생 후보보다 접근 빈도 어림값이 클 때만 영역의 리스트로 옮겨 감. 한 번만 쓰이는 uri를
+// 훑는 요청이 자주 쓰는 항목들을 밀어내지 못하게 함. -A 옵션으로 끔
+#define CACHE_WINDOW_PCT 1 // 영역 항목 가운데 윈도에 두는 비율(%). 최소 1개
+#define SKETCH_ROWS 4      // count-min sketch의 행 수
+#define SKETCH_MAX 15      // 카운터 최댓값
+#define SKETCH_OBJECT 1024 // sketch 폭을 정할 때 가정하는 평균 항목 크기. 폭은 capacity / SKETCH_OBJECT 이상의 2의 거듭제곱
+
+// chunk의 상태
+#define CHUNK_FREE 0     // 클래스의 빈 chunk 목록에 있음
+#define CHUNK_RESERVED 1 // 할당되어 내용을 채우는 중
+#define CHUNK_LINKED 2   // 인덱스와 정책 영역(또는 윈도)의 리스트에 들어 있음
+#define CHUNK_RETIRED 3  // 인덱스에서 빠졌지만 아직 응답을 보내는 독자가 있음
+
+// 캐시 항목 하나. chunk의 맨 앞에 놓이고, 응답과 uri는 구조체 바로 뒤에 이어 붙임.
+// 인덱스에 넣은 뒤로 cache_obj, size, cache_uri, hash, expires는 바뀌지 않음
+typedef struct cache_block
+{
+    char *cache_obj; // 저장된 응답 (헤더 포함)
+    size_t size;     // cache_obj에 저장된 응답의 길이
+    size_t hdrlen;   // 빈 줄 앞까지의 헤더 길이. 히트를 보낼 때 이 뒤에 Connection 줄을 끼워 넣음. 0이면 헤더가 없는 항목
+    char *cache_uri;
+    uint64_t hash;   // cache_uri의 해시. 인덱스 탐색 시 strcmp 전에 먼저 비교함
+    time_t expires;  // 이 시각부터는 미스로 처리함. 0이면 만료되지 않음 (재생 벤치마크가 넣는 항목)
+    struct cache_block *prev, *next; // 리스트의 이웃 항목 (앞쪽이 최근에 넣은 항목). 빈 chunk와 CHUNK_RETIRED chunk는 next로 목록을 이룸
+    unsigned long atime; // 저장되거나 리스트 앞으로 옮겨진 시점의 c->clock
+    unsigned long epoch; // CHUNK_RETIRED가 될 때 epoch_retire가 준 값. 이 값 이하에서 인덱스를 읽기 시작한 스레드가 남아 있으면 다시 쓰지 않음
+    int cls;         // chunk의 크기 클래스
+    int state;       // CHUNK_FREE, CHUNK_RESERVED, CHUNK_LINKED, CHUNK_RETIRED
+    int list;        // 들어 있는 리스트. CACHE_WINDOW면 영역의 윈도, 아니면 영역의 list[list]
+    // 아래 둘은 잠금 없이 히트하는 스레드도 바꾸므로 __atomic으로 읽고 씀
+    int referenced;  // 히트 표시. CLOCK은 1로, S3-FIFO는 S3FIFO_FREQ_MAX까지 올리고 차출할 차례에 줄임. LRU와 ARC는 옮기지 못한 히트.
+                     // 0이 아니면 최근에 쓰인 항목
+    int refcnt;      // cache_find로 찾아 아직 readend를 부르지 않은 독자 수
+} cache_block;
+
+// 항목 리스트. 정책 영역의 리스트와 윈도 리스트가 같은 구조를 씀
+typedef struct
+{
+    cache_block *head, *tail; // 처음(가장 최근)과 끝(가장 오래됨)
+    int nitems;               // 차출할 샤드를 고를 때 잠금 없이 읽으므로 __atomic으로 셈
+} cache_lru;
+
+#define CACHE_WINDOW -1 // cache_block.list 값. 영역의 윈도에 있음
+
+// 차출한 항목의 uri 해시를 기억하는 원형 버퍼. 0은 빈 칸이고, 가득 차면 가장 오래된 해시를 덮어씀
+typedef struct
+{
+    uint64_t *hashes; // 처음 넣을 때 할당함
+    int size;
+    int head;         // 다음에 넣을 칸
+    int count;        // 빈 칸이 아닌 해시 수
+} cache_ghost;
+
+// 한 샤드에서 한 클래스에 속한 항목들을 차출 정책이 관리하는 영역.
+// LRU와 CLOCK은 list[0]만, S3-FIFO는 list[0](작은 FIFO)와 list[1](본 FIFO)과 ghost[0]을,
+// ARC는 list[0](T1)과 list[1](T2)과 ghost[0](B1), ghost[1](B2)과 target(T1의 목표 항목 수 p)을 씀.
+// 입장 제어를 쓰면 새 항목은 window에 먼저 들어감
+typedef struct
+{
+    cache_lru list[2];
+    cache_ghost ghost[2];
+    int target;
+    cache_lru window;
+} cache_region;
+
+typedef struct
+{
+    size_t size;              // chunk 크기
+    int perpage;              // 페이지 하나에서 나오는 chunk 수
+    int npages;               // 이 클래스에 배정된 페이지 수
+    int nitems;               // 모든 샤드에 저장된 이 클래스 항목 수. 샤드 잠금만 잡고 바꾸므로 __atomic으로 셈
+    cache_block *freelist;    // 빈 chunk 목록
+    cache_block *retired;     // 차출했지만 독자가 남아 있어 아직 다시 쓸 수 없는 chunk 목록
+    unsigned long evictions;  // 이 클래스에서 차출한 항목 수
+    unsigned long pressure;   // 페이지 이동을 마지막으로 시도한 뒤 이 클래스 안에서 차출한 항목 수
+} slab_class;
+
+// uri 해시 -> 항목 인덱스 (선형 탐사, 빈 슬롯은 NULL). 슬롯 수를 늘릴 때는 새 인덱스를 만들어 통째로 바꿔 끼움
+typedef struct cache_index
+{
+    int nslots;          // 2의 거듭제곱
+    unsigned long epoch; // 바꿔 끼운 뒤 버릴 때 epoch_retire가 준 값
+    struct cache_index *next; // 버린 인덱스 목록 (s->old_indexes)
+    cache_block *slots[];
+} cache_index;
+
+// 캐시 샤드. 인덱스와 정책 영역과 사용량을 따로 가지고 자기 잠금으로 보호하므로, 다른 샤드에 저장하거나 차출하는
+// 스레드끼리는 기다리지 않음. 항목이 차지하는 chunk는 캐시 전체의 슬랩에서 받음. 히트는 잠금 없이 index를 읽음
+typedef struct
+{
+    cache_index *index;
+    int nentries;        // index의 슬롯 수는 nentries의 2배 이상을 유지함
+    cache_region region[SLAB_MAX_CLASSES]; // 클래스별 정책 영역
+    size_t used;         // 이 샤드 항목들의 chunk 크기 합. 차출할 샤드를 고를 때 잠금 없이 읽음
+    cache_index *old_indexes; // 바꿔 끼운 뒤 아직 읽는 스레드가 남아 있을 수 있는 인덱스
+    sem_t mutex;         // 인덱스 변경, 정책 영역, used, 이 샤드 항목의 CHUNK_LINKED -> CHUNK_RETIRED 보호
+} cache_shard;
+
+// uri별 접근 빈도를 어림하는 count-min sketch. 행마다 uri 해시로 다른 카운터를 골라 올리고, 행들 가운데 가장 작은 값을
+// 빈도로 봄. 접근을 sample번 기록할 때마다 모든 카운터를 절반으로 줄여 예전 빈도를 잊음.
+// 히트하는 스레드도 잠금 없이 기록하므로 카운터는 __atomic으로 다루고, 드물게 올린 값을 잃는 것은 허용함
+typedef struct
+{
+    uint8_t *table;          // SKETCH_ROWS * width개의 카운터
+    int width;               // 2의 거듭제곱
+    unsigned long additions; // 마지막으로 절반으로 줄인 뒤 기록한 접근 수
+    unsigned long sample;
+} cache_sketch;
+
+typedef struct cache_policy cache_policy;
+
+#define EPOCH_MAX_THREADS 1024
+
+typedef struct
+{
+    unsigned long epoch; // 인덱스를 읽는 중이면 읽기 시작할 때의 c->epoch_now, 아니면 0
+    char pad[64 - sizeof(unsigned long)]; // 스레드마다 다른 캐시 라인을 쓰게 함
+} epoch_slot;
+
+typedef struct
+{
+    cache_shard *shards;
+    int nshards;
+    size_t share;        // 샤드 하나의 바이트 예산 = capacity / nshards
+    slab_class classes[SLAB_MAX_CLASSES];
+    int nclasses;
+    char *arena;         // 미리 잡아 둔 페이지들. 페이지는 처음 배정될 때 실제 메모리가 잡힘
+    int *page_class;     // 페이지 -> 배정된 클래스. 아직 배정되지 않았으면 -1
+    size_t page_size;    // 페이지 크기. 보통 SLAB_PAGE_SIZE이고, 작은 캐시는 페이지가 SLAB_MIN_PAGES개 나오도록 줄임
+    int npages;          // arena의 페이지 수 = capacity / page_size
+    int pages_used;      // 클래스에 배정된 페이지 수. arena 앞쪽부터 차례로 배정함
+    size_t capacity;     // 바이트 예산. 샤드 모드에서는 전체 용량을 샤드 수로 나눠 가짐
+    size_t used;         // 저장된 항목들의 chunk 크기 합. __atomic으로 셈
+    unsigned long clock;      // 항목을 리스트 앞에 넣을 때마다 1씩 늘어나는 논리 시각. 샤드마다 잠금이 달라 __atomic으로 올림
+    unsigned long rebalances; // 클래스 사이에서 페이지를 옮긴 횟수
+    int demote;          // 1이면 차출한 항목을 디스크 캐시로 내려보냄
+    const cache_policy *policy;
+    int admission;       // 1이면 W-TinyLFU 입장 제어를 씀. 0이면 새 항목을 바로 정책 영역에 넣음
+    cache_sketch sketch;
+    unsigned long admitted, rejected; // 윈도에서 밀려난 항목이 영역으로 옮겨 간 수와 빈도에서 져 차출된 수. __atomic으로 셈
+    unsigned long hits, misses, hitbytes; // cache_find의 결과. 잠금 없이 __atomic으로 셈
+    unsigned long expired; // 만료되어 cache_find가 뺀 항목 수 (misses에도 들어감). __atomic으로 셈
+    epoch_slot *epoch_slots; // 스레드 번호(epoch_id) -> 이 캐시의 인덱스를 읽는 중인지. 캐시마다 따로 두어 샤드끼리 기다리지 않음
+    unsigned long epoch_now;
+    sem_t mutex;         // 슬랩 잠금. 클래스의 빈 목록과 회수 대기 목록, 페이지 배정, 차출 수 보호.
+                         // 샤드 잠금을 잡은 채 잡을 수 있지만 반대 순서로는 잡지 않음
+} Cache;
+
+// 차출 정책의 구현. 모든 함수는 영역이 속한 샤드의 잠금을 잡은 상태에서 불리고, hit만 잠금 없이 불림
+struct cache_policy
+{
+    char *name;
+    void (*link)(Cache *c, cache_region *r, cache_block *b);   // 새 항목(또는 윈도에서 옮겨 오는 항목)을 영역에 넣음
+    void (*unlink)(Cache *c, cache_region *r, cache_block *b); // 차출하는 항목을 영역에서 뺌
+    void (*hit)(Cache *c, cache_block *b);                     // cache_find가 항목을 찾았음
+    cache_block *(*victim)(Cache *c, cache_region *r);         // 영역에서 차출할 항목을 고름. 없으면 NULL
+};
+
+extern const cache_policy cache_policies[POLICY_COUNT];
+int cache_default_policy = POLICY_CLOCK; // cache_init이 새 캐시에 쓰는 정책 (-P)
+int cache_default_admission = 1;         // cache_init이 새 캐시에 W-TinyLFU 입장 제어를 켤지 (-A로 끔)
+
+// 스레드 풀 및 단일 이벤트 루프가 함께 쓰는 cache 구조체 선언
+Cache cache;
+
+// 요청 기록 (-r). 스레드 풀 모드에서 요청마다 "GET uri", 메모리 캐시에 저장할 때마다 "SIZE 길이 uri" 줄을 남김.
+// 시뮬레이터(-T)는 GET 줄을 요청열로, SIZE 줄을 응답 길이로 씀
+FILE *trace_fp;
+
+typedef struct ev_conn ev_conn;
+typedef struct ev_dns ev_dns;
+
+// 이벤트 루프 연결의 마감 시각 종류. 종류마다 제한 시간이 정해져 있음
+typedef enum
+{
+    EV_TIMER_HEADER,  // 요청 헤더를 다 받을 때까지
+    EV_TIMER_RESOLVE, // DNS 조회를 마칠 때까지
+    EV_TIMER_CONNECT, // 주소 하나에 connect하고 요청을 다 보낼 때까지. 지나면 다음 주소로 넘어감
+    EV_TIMER_IDLE,    // 중계 중 클라이언트에게 아무것도 보내지 못한 채로
+    EV_NTIMERS
+} ev_timer;
+
+// epoll 이벤트 루프 하나가 사용하는 로컬 상태.
+// 샤드 모드(-s)에서는 샤드마다 SO_REUSEPORT 리스너, 캐시, 버퍼, 카운터를 따로 가짐
+typedef struct
+{
+    int id;
+    int listenfd;
+    int epfd;
+    int cpu;              // 고정할 CPU 번호. -1이면 고정하지 않음
+    Cache *cache;
+    char **freebufs;      // 재사용할 중계 버퍼 목록
+    int nfree;
+    int dnsfd;            // DNS 도우미 스레드가 조회를 마치면 루프를 깨우는 eventfd
+    pthread_mutex_t dnslock;
+    ev_dns *dnsdone;      // 도우미 스레드가 조회를 마친 요청 목록 (dnslock)
+    long long now;        // 루프가 마지막으로 읽은 단조 시계 (ms)
+    ev_conn *timers[EV_NTIMERS], *timertails[EV_NTIMERS]; // 종류별 마감 시각 목록. 건 순서 = 마감 순서
+    unsigned long accepted, requests, hits, misses, bytes, timeouts;
+} shard_t;
+
+void cache_init(Cache *c, size_t capacity);
+void cache_free(Cache *c);
+void cache_stats(Cache *c, char *name);
+void cache_bench();
+void cache_simulate(char *path);
+int cache_check();
+void rio_bench();
+void *thread_routine(void *vargp);
+void serve_client(int connfd);
+int doit(int connfd, rio_t *rio, int last);
+void event_init();
+void event_loop(shard_t *sh);
+void run_shards(char *port, int nshards, int pin);
 int parse_uri(char *uri, char *hostname, char *path, int *port);
-void makeHTTPheader(char *HTTPheader, char *hostname, char *path, int port, rio_t *client_rio);
+int makeHTTPheader(char *HTTPheader, char *hostname, char *path, int port, rio_t *client_rio, int *keepalive, int persistent);
+void pool_init();
+void fill_init();
+void large_init();
+void large_stats();
+void disk_init(char *path, size_t capacity);
+void disk_demote(char *uri, char *obj, size_t size, size_t hdrlen, time_t expires);
+void disk_stats();
+void snapshot_load(char *path);
+void *snapshot_routine(void *vargp);
+int pool_checkout(char *hostname, char *port, int *reused);
+void pool_checkin(char *hostname, char *port, int fd);
+void pool_stats();
+void dns_stats();
+void *stats_routine(void *vargp);
+
+// 응답 본문을 중계할 때 한 번에 읽는 블록 크기
+#define RELAY_BLOCK 65536
+
+// 클라이언트 연결 유지(keep-alive) 제한
+#define KEEPALIVE_TIMEOUT 5 // 다음 요청(첫 요청 포함)의 첫 바이트를 기다리는 최대 시간(초)
+#define HEADER_TIMEOUT 10   // 요청 줄부터 빈 줄까지 요청 헤더 전체를 받을 최대 시간(초)
+#define KEEPALIVE_MAX 100   // 한 연결에서 처리할 최대 요청 수
+
+// 스레드 풀 기본값. 워커 수와 큐 깊이는 -t, -q 옵션으로 바꿀 수 있음
+#define NTHREADS 16
+#define SBUFSIZE 256
+
+// 생산자(main의 Accept 루프)와 소비자(워커 스레드)가 connfd를 주고받는 유한 원형 버퍼
+typedef struct
+{
+    int *buf;    // connfd 배열
+    int n;       // 최대 슬롯 수
+    int front;   // buf[(front+1)%n]이 첫 번째 항목
+    int rear;    // buf[rear%n]이 마지막 항목
+    sem_t mutex; // buf 접근 보호
+    sem_t slots; // 빈 슬롯 수
+    sem_t items; // 사용 가능한 항목 수
+} sbuf_t;
+
+sbuf_t sbuf;
+
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+// 빈 슬롯이 없으면 기다리지 않고 0을 리턴함. 넣었으면 1
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    if (sem_trywait(&sp->slots) < 0)
+    {
+        if (errno != EAGAIN)
+            unix_error("sem_trywait error");
+        return 0;
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+    return 1;
+}
+
+// 항목이 들어올 때까지 기다렸다가 가장 앞의 connfd를 꺼냄
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+static const char *busy_response = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
+static const char *too_large_response = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\nContent-length: 0\r\n\r\n";
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-e] [-s shards [-p]] [-t threads] [-q queue] [-c ms] [-d file] [-S file] [-P policy] [-A] [-r file] <port>\n", prog);
+    fprintf(stderr, "       %s [-b] [-T file] [-C] [-L]\n", prog);
+    fprintf(stderr, "  -e  epoll 기반 이벤트 루프로 동작 (기본: 스레드 풀)\n");
+    fprintf(stderr, "  -s  SO_REUSEPORT 리스너와 이벤트 루프를 가진 샤드 수\n");
+    fprintf(stderr, "  -p  샤드 i를 CPU (i %% CPU 수)에 고정\n");
+    fprintf(stderr, "  -t  워커 스레드 수 (기본 %d)\n", NTHREADS);
+    fprintf(stderr, "  -q  대기 중인 연결을 담는 큐 깊이 (기본 %d)\n", SBUFSIZE);
+    fprintf(stderr, "  -c  서버 주소 하나에 connect를 시도하는 제한 시간(ms)\n");
+    fprintf(stderr, "  -d  메모리 캐시에서 차출한 항목을 내려보낼 디스크 캐시 파일 (스레드 풀 모드)\n");
+    fprintf(stderr, "  -P  메모리 캐시의 차출 정책: lru, clock, s3fifo, arc (기본 clock)\n");
+    fprintf(stderr, "  -A  W-TinyLFU 입장 제어를 끔\n");
+    fprintf(stderr, "  -r  요청과 저장한 응답 길이를 기록할 파일 (스레드 풀 모드)\n");
+    fprintf(stderr, "  -b  모든 정책의 히트율을 비교하는 재생 벤치마크와 항목 수에 따른 저장/히트 비용 측정을 실행하고 종료\n");
+    fprintf(stderr, "  -T  -r로 기록한 요청열을 모든 정책으로 재생하는 시뮬레이터를 실행하고 종료\n");
+    fprintf(stderr, "  -C  모든 크기 클래스에 항목을 저장할 수 있는지 슬랩을 점검하고 종료\n");
+    fprintf(stderr, "  -L  요청 헤더 블록을 rio_readlineb로 읽는 벤치마크를 실행하고 종료\n");
+    fprintf(stderr, "  -S  시작할 때 불러오고 주기적으로, 그리고 종료할 때 캐시를 저장할 스냅샷 파일 (스레드 풀 모드)\n");
+    exit(1);
+}
+
+// main function
+// 프록시 서버 과제의 sequantial 및 concurrent와 관련된 주석은 생략함.
+int main(int argc, char **argv)
+{
+    int listenfd, connfd, opt, eventmode = 0, nshards = 0, pin = 0;
+    int nthreads = NTHREADS, sbufsize = SBUFSIZE, i;
+    char *diskpath = NULL, *snappath = NULL;
+    shard_t sh;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
+    sigset_t mask;
+    while ((opt = getopt(argc, argv, "es:pt:q:c:d:S:bP:AT:r:CL")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            eventmode = 1;
+            break;
+        case 's':
+            nshards = atoi(optarg);
+            break;
+        case 'p':
+            pin = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'q':
+            sbufsize = atoi(optarg);
+            break;
+        case 'c':
+            open_clientfd_timeouts(0, atoi(optarg));
+            break;
+        case 'd':
+            diskpath = optarg;
+            break;
+        case 'S':
+            snappath = optarg;
+            break;
+        case 'b':
+            cache_bench();
+            return 0;
+        case 'T':
+            cache_simulate(optarg);
+            return 0;
+        case 'C':
+            return cache_check();
+        case 'L':
+            rio_bench();
+            return 0;
+        case 'P':
+            for (i = 0; i < POLICY_COUNT && strcmp(optarg, cache_policies[i].name); i = i + 1)
+                ;
+            if (i == POLICY_COUNT)
+                usage(argv[0]);
+            cache_default_policy = i;
+            break;
+        case 'A':
+            cache_default_admission = 0;
+            break;
+        case 'r':
+            trace_fp = Fopen(optarg, "w");
+            setvbuf(trace_fp, NULL, _IOLBF, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nthreads <= 0 || sbufsize <= 0 || nshards < 0)
+        usage(argv[0]);
+    // 클라이언트가 먼저 연결을 끊어도 write 실패로만 처리되도록 함
+    Signal(SIGPIPE, SIG_IGN);
+    // 샤드 모드에서는 샤드마다 리스너와 캐시를 따로 만들기 때문에 공용 캐시를 쓰지 않음
+    if (nshards > 0)
+    {
+        run_shards(argv[optind], nshards, pin);
+        return 0;
+    }
+    cache_init(&cache, MAX_CACHE_SIZE);
+    listenfd = Open_listenfd(argv[optind]);
+    // 이벤트 모드에서는 스레드 없이 하나의 루프가 모든 연결을 처리함
+    if (eventmode)
+    {
+        memset(&sh, 0, sizeof(shard_t));
+        sh.listenfd = listenfd;
+        sh.cpu = -1;
+        sh.cache = &cache;
+        event_init();
+        event_loop(&sh);
+        return 0;
+    }
+    // 워커들이 SIGUSR1을 가로채지 않도록 막아두고, 통계 스레드만 sigwait로 받음.
+    // 스냅샷을 쓸 때는 SIGTERM/SIGINT도 막아 두고 스냅샷 스레드가 받아 저장한 뒤 종료함
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    if (snappath)
+    {
+        Sigaddset(&mask, SIGTERM);
+        Sigaddset(&mask, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pool_init();
+    fill_init();
+    large_init();
+    if (diskpath)
+    {
+        disk_init(diskpath, DISK_CACHE_SIZE);
+        cache.demote = 1;
+    }
+    // 스냅샷은 Accept 루프를 시작하기 전에 다 넣어 두어, 첫 요청부터 이전 캐시로 응답함
+    if (snappath)
+    {
+        snapshot_load(snappath);
+        Pthread_create(&tid, NULL, snapshot_routine, snappath);
+    }
+    Pthread_create(&tid, NULL, stats_routine, NULL);
+    // 연결마다 스레드를 만드는 대신 워커를 미리 만들어 두고 sbuf로 connfd를 넘겨줌
+    sbuf_init(&sbuf, sbufsize);
+    for (i = 0; i < nthreads; i = i + 1)
+        Pthread_create(&tid, NULL, thread_routine, NULL);
+    while (1)
+    {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        // 큐가 가득 차면 Accept 루프를 막지 않고 503으로 응답한 뒤 연결을 끊음
+        if (!sbuf_tryinsert(&sbuf, connfd))
+        {
+            printf("queue full, dropping connection from (%s, %s)\n", hostname, port);
+            rio_writen(connfd, (void *)busy_response, strlen(busy_response));
+            Close(connfd);
+        }
+    }
+    return 0;
+}
+
+void *thread_routine(void *vargp)
+{
+    int connfd;
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        connfd = sbuf_remove(&sbuf);
+        serve_client(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
+// SIGUSR1을 받을 때마다 통계를 출력함
+void *stats_routine(void *vargp)
+{
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    while (1)
+    {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        cache_stats(&cache, "cache");
+        large_stats();
+        disk_stats();
+        pool_stats();
+        dns_stats();
+    }
+    return NULL;
+}
+
+// open_clientfd 앞단의 DNS 캐시 통계
+void dns_stats()
+{
+    dns_stats_t st;
+
+    dns_cache_stats(&st);
+    printf("dns cache: hits %lu, negative hits %lu, misses %lu, coalesced %lu, numeric %lu\n",
+           st.hits, st.negative_hits, st.misses, st.coalesced, st.numeric);
+    fflush(stdout);
+}
+
+// 캐시 키로 쓸 uri를 정규화함. scheme과 host는 소문자로 바꾸고, 기본 포트(:80)와 fragment는 지우고, 빈 경로는 "/"로 채움.
+// out은 MAXLINE 크기
+void uri_normalize(char *uri, char *out)
+{
+    char *p = uri, *o = out, *end = out + MAXLINE - 1;
+
+    if (!strncasecmp(p, "http://", 7))
+    {
+        strcpy(o, "http://");
+        o += 7;
+        p += 7;
+        while (*p && *p != '/' && *p != ':' && *p != '?' && *p != '#' && o < end)
+            *o++ = tolower((unsigned char)*p++);
+        if (*p == ':')
+        {
+            if (!strncmp(p, ":80", 3) && (p[3] == '\0' || p[3] == '/' || p[3] == '?' || p[3] == '#'))
+                p += 3;
+            else
+                while (*p && *p != '/' && *p != '?' && *p != '#' && o < end)
+                    *o++ = *p++;
+        }
+        if (*p != '/' && o < end)
+            *o++ = '/';
+    }
+    while (*p && *p != '#' && o < end)
+        *o++ = *p++;
+    *o = '\0';
+}
+
+// 64비트 해시 (MurmurHash64A)
+uint64_t hash64(const void *key, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    const unsigned char *data = key, *end = data + (len & ~(size_t)7);
+    uint64_t h = 0x9747b28cULL ^ (len * m), k;
+
+    for (; data != end; data += 8)
+    {
+        memcpy(&k, data, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7)
+    {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)data[1] << 8;  /* fall through */
+    case 1: h ^= (uint64_t)data[0];
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// 캐시 항목 회수에 쓰는 epoch. 히트는 인덱스를 읽는 동안만 자기 슬롯에 그때의 c->epoch_now를 적어 두고,
+// 항목을 인덱스에서 뺀 쪽은 epoch_retire로 c->epoch_now를 올리고 그 전 값을 항목에 적어 회수 대기 목록에 넣음.
+// 그 값 이하를 적은 슬롯이 모두 비면 누구도 빠진 항목을 새로 찾을 수 없으므로 refcnt가 0이면 chunk를 다시 씀.
+// 기다리지 않고 다음 할당 때 epoch_oldest로 확인해 회수하므로 캐시 잠금을 잡은 채 다른 스레드를 기다리는 일이 없음
+static int epoch_nthreads;          // 번호를 받아 간 스레드 수
+static __thread int epoch_id = -1;  // 이 스레드의 슬롯 번호. 처음 캐시를 읽을 때 받고 모든 캐시에서 같은 번호를 씀
+
+static void epoch_enter(Cache *c)
+{
+    if (epoch_id < 0)
+    {
+        epoch_id = __atomic_fetch_add(&epoch_nthreads, 1, __ATOMIC_SEQ_CST);
+        if (epoch_id >= EPOCH_MAX_THREADS)
+            app_error("cache: too many threads");
+    }
+    __atomic_store_n(&c->epoch_slots[epoch_id].epoch, __atomic_load_n(&c->epoch_now, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+static void epoch_exit(Cache *c)
+{
+    __atomic_store_n(&c->epoch_slots[epoch_id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// 인덱스에서 뺀 항목이나 바꿔 끼운 인덱스에 적을 값. 이 뒤에 읽기 시작한 스레드는 더 큰 값을 적으므로 뺀 것을 볼 수 없음
+static unsigned long epoch_retire(Cache *c)
+{
+    return __atomic_fetch_add(&c->epoch_now, 1, __ATOMIC_SEQ_CST);
+}
+
+// 아직 인덱스를 읽고 있는 스레드가 읽기 시작한 가장 이른 epoch. 이보다 작은 값을 적은 것은 다시 써도 됨.
+// 슬롯을 훑기만 하고 기다리지 않음
+static unsigned long epoch_oldest(Cache *c)
+{
+    unsigned long oldest = __atomic_load_n(&c->epoch_now, __ATOMIC_SEQ_CST), e;
+    int i, n = __atomic_load_n(&epoch_nthreads, __ATOMIC_SEQ_CST);
+
+    if (n > EPOCH_MAX_THREADS)
+        n = EPOCH_MAX_THREADS;
+    for (i = 0; i < n; i = i + 1)
+        if ((e = __atomic_load_n(&c->epoch_slots[i].epoch, __ATOMIC_SEQ_CST)) != 0 && e < oldest)
+            oldest = e;
+    return oldest;
+}
+
+// epoch 이하에서 읽기 시작한 스레드가 모두 빠져나올 때까지 기다림. 읽는 구간은 해시 탐색뿐이라 짧음.
+// 페이지를 통째로 넘겨받을 때만 쓰고, 캐시 잠금을 모두 놓은 상태에서 부름
+static void epoch_wait(Cache *c, unsigned long epoch)
+{
+    while (epoch_oldest(c) <= epoch)
+        sched_yield();
+}
+
+static cache_index *index_alloc(int nslots)
+{
+    cache_index *idx = Calloc(1, sizeof(cache_index) + nslots * sizeof(cache_block *));
+
+    idx->nslots = nslots;
+    return idx;
+}
+
+// 캐시 초기화. capacity는 슬랩 페이지로 쓸 전체 바이트이고, 페이지 크기 단위로 내림하므로 넘지 않음.
+// 페이지보다 큰 항목은 저장하지 않으므로, 페이지 크기를 줄인 작은 캐시는 큰 응답을 캐시하지 않는 대신 예산을 지킴
+void cache_init(Cache *c, size_t capacity)
+{
+    double size = SLAB_MIN_CHUNK;
+    slab_class *sc;
+    int i;
+
+    memset(c, 0, sizeof(Cache));
+    c->nshards = CACHE_SHARDS;
+    c->shards = Calloc(c->nshards, sizeof(cache_shard));
+    for (i = 0; i < c->nshards; i = i + 1)
+    {
+        c->shards[i].index = index_alloc(64);
+        Sem_init(&c->shards[i].mutex, 0, 1);
+    }
+    for (c->page_size = SLAB_PAGE_SIZE; c->page_size > SLAB_MIN_PAGE_SIZE && capacity / c->page_size < SLAB_MIN_PAGES;
+         c->page_size /= 2)
+        ;
+    // chunk 크기는 SLAB_MIN_CHUNK부터 SLAB_GROWTH배씩 키우고, 마지막 클래스는 페이지 전체를 chunk 하나로 씀
+    while (c->nclasses < SLAB_MAX_CLASSES)
+    {
+        sc = &c->classes[c->nclasses++];
+        sc->size = ((size_t)size + 7) & ~(size_t)7;
+        if (sc->size * SLAB_GROWTH >= c->page_size || c->nclasses == SLAB_MAX_CLASSES)
+            sc->size = c->page_size;
+        sc->perpage = c->page_size / sc->size;
+        if (sc->size == c->page_size)
+            break;
+        size = size * SLAB_GROWTH;
+    }
+    // 용량이 가장 작은 페이지 하나도 안 되면 페이지 없이 두어 아무것도 저장하지 않음
+    c->npages = capacity / c->page_size;
+    c->capacity = (size_t)c->npages * c->page_size;
+    c->share = c->capacity / c->nshards;
+    c->arena = Malloc(c->capacity);
+    c->page_class = Malloc(c->npages * sizeof(int));
+    for (i = 0; i < c->npages; i = i + 1)
+        c->page_class[i] = -1;
+    c->policy = &cache_policies[cache_default_policy];
+    c->admission = cache_default_admission;
+    for (c->sketch.width = 64; (size_t)c->sketch.width < c->capacity / SKETCH_OBJECT; c->sketch.width *= 2)
+        ;
+    c->sketch.table = Calloc(SKETCH_ROWS * c->sketch.width, 1);
+    c->sketch.sample = 10 * (unsigned long)c->sketch.width;
+    c->epoch_slots = Calloc(EPOCH_MAX_THREADS, sizeof(epoch_slot));
+    c->epoch_now = 1;
+    Sem_init(&c->mutex, 0, 1);
+}
+
+// cache_init이 잡은 메모리를 모두 놓음. 항목은 arena 안에 있으므로 따로 놓지 않음.
+// 다른 스레드가 쓰지 않는 캐시(재생 벤치마크, 슬랩 점검)에만 부름
+void cache_free(Cache *c)
+{
+    cache_index *idx;
+    int i, j;
+
+    for (i = 0; i < c->nshards; i = i + 1)
+    {
+        Free(c->shards[i].index);
+        while ((idx = c->shards[i].old_indexes) != NULL)
+        {
+            c->shards[i].old_indexes = idx->next;
+            Free(idx);
+        }
+        for (j = 0; j < c->nclasses; j = j + 1)
+        {
+            Free(c->shards[i].region[j].ghost[0].hashes);
+            Free(c->shards[i].region[j].ghost[1].hashes);
+        }
+        sem_destroy(&c->shards[i].mutex);
+    }
+    Free(c->shards);
+    Free(c->arena);
+    Free(c->page_class);
+    Free(c->sketch.table);
+    Free(c->epoch_slots);
+    sem_destroy(&c->mutex);
+}
+
+// 해시의 두 절반으로 행마다 다른 카운터 위치를 만듦
+static uint8_t *sketch_counter(cache_sketch *k, uint64_t hash, int row)
+{
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+
+    return &k->table[row * k->width + ((h1 + row * h2) & (k->width - 1))];
+}
+
+// uri 해시 hash의 접근을 하나 기록함
+static void sketch_add(cache_sketch *k, uint64_t hash)
+{
+    uint8_t *ctr;
+    int i;
+
+    for (i = 0; i < SKETCH_ROWS; i = i + 1)
+    {
+        ctr = sketch_counter(k, hash, i);
+        if (__atomic_load_n(ctr, __ATOMIC_RELAXED) < SKETCH_MAX)
+            __atomic_add_fetch(ctr, 1, __ATOMIC_RELAXED);
+    }
+    // sample번째 기록을 한 스레드 하나만 카운터를 줄임
+    if (__atomic_add_fetch(&k->additions, 1, __ATOMIC_RELAXED) == k->sample)
+    {
+        for (i = 0; i < SKETCH_ROWS * k->width; i = i + 1)
+            __atomic_store_n(&k->table[i], __atomic_load_n(&k->table[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&k->additions, k->sample / 2, __ATOMIC_RELAXED);
+    }
+}
+
+static int sketch_estimate(cache_sketch *k, uint64_t hash)
+{
+    int i, v, min = SKETCH_MAX;
+
+    for (i = 0; i < SKETCH_ROWS; i = i + 1)
+        if ((v = __atomic_load_n(sketch_counter(k, hash, i), __ATOMIC_RELAXED)) < min)
+            min = v;
+    return min;
+}
+
+// cache_find로 찾은 항목을 다 보냈음을 알림. 마지막 독자가 놓은 차출된 chunk는 다음 할당 때 빈 목록으로 돌아감
+void readend(cache_block *b)
+{
+    __atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_RELEASE);
+}
+
+// uri 해시가 속한 샤드. 샤드 안의 인덱스는 하위 비트를 쓰므로 상위 비트로 고름
+static cache_shard *cache_shard_of(Cache *c, uint64_t hash)
+{
+    return &c->shards[(hash >> 48) & (c->nshards - 1)];
+}
+
+// 샤드 인덱스에서 uri를 담은 항목을 찾음. 없으면 NULL.
+// epoch_enter 뒤에 잠금 없이 부르거나 s->mutex를 잡은 상태에서 호출함. 잠금 없이 읽는 동안 index_remove가 항목을
+// 앞으로 당기고 있으면 있는 항목을 못 찾을 수 있는데, 그때는 미스로 처리되어 서버에서 다시 가져옴
+static cache_block *index_lookup(cache_shard *s, char *uri, uint64_t hash)
+{
+    cache_index *idx = __atomic_load_n(&s->index, __ATOMIC_ACQUIRE);
+    int mask = idx->nslots - 1, i;
+    cache_block *b;
+
+    for (i = hash & mask; (b = __atomic_load_n(&idx->slots[i], __ATOMIC_ACQUIRE)) != NULL; i = (i + 1) & mask)
+        if (b->hash == hash && !strcmp(b->cache_uri, uri))
+            return b;
+    return NULL;
+}
+
+// 항목을 샤드 인덱스에 넣음. 항목 내용을 모두 채운 뒤에 부름. 부하율이 1/2을 넘으면 두 배 크기의 새 인덱스로
+// 바꿔 끼우고, 옛 인덱스는 s->old_indexes에 두었다가 읽던 스레드가 모두 빠져나온 뒤 index_reclaim이 해제함.
+// s->mutex를 잡은 상태에서 호출함
+static void index_insert(Cache *c, cache_shard *s, cache_block *b)
+{
+    cache_index *old = s->index, *idx = old;
+    int mask, i, j;
+
+    if (2 * (s->nentries + 1) > old->nslots)
+    {
+        idx = index_alloc(old->nslots * 2);
+        mask = idx->nslots - 1;
+        for (j = 0; j < old->nslots; j = j + 1)
+        {
+            if (!old->slots[j])
+                continue;
+            for (i = old->slots[j]->hash & mask; idx->slots[i]; i = (i + 1) & mask)
+                ;
+            idx->slots[i] = old->slots[j];
+        }
+        __atomic_store_n(&s->index, idx, __ATOMIC_RELEASE);
+        old->epoch = epoch_retire(c);
+        old->next = s->old_indexes;
+        s->old_indexes = old;
+    }
+    mask = idx->nslots - 1;
+    for (i = b->hash & mask; idx->slots[i]; i = (i + 1) & mask)
+        ;
+    __atomic_store_n(&idx->slots[i], b, __ATOMIC_RELEASE);
+    s->nentries++;
+}
+
+// 샤드가 버린 인덱스 가운데 oldest(epoch_oldest) 전에 버린 것을 해제함. s->mutex를 잡은 상태에서 호출함
+static void index_reclaim(cache_shard *s, unsigned long oldest)
+{
+    cache_index **pp = &s->old_indexes, *idx;
+
+    while ((idx = *pp) != NULL)
+    {
+        if (idx->epoch < oldest)
+        {
+            *pp = idx->next;
+            Free(idx);
+        }
+        else
+            pp = &idx->next;
+    }
+}
+
+// 항목을 샤드 인덱스에서 뺌. 삭제 표시를 남기지 않도록 뒤따르는 항목들을 앞으로 당김. s->mutex를 잡은 상태에서 호출함
+static void index_remove(cache_shard *s, cache_block *b)
+{
+    cache_index *idx = s->index;
+    int mask = idx->nslots - 1, i, j, home;
+
+    for (i = b->hash & mask; idx->slots[i] != b; i = (i + 1) & mask)
+        ;
+    for (j = (i + 1) & mask; idx->slots[j]; j = (j + 1) & mask)
+    {
+        // j의 항목이 원래 들어가야 할 자리가 (i, j] 사이면 그대로 두고, 아니면 빈 자리 i로 당김
+        home = idx->slots[j]->hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        __atomic_store_n(&idx->slots[i], idx->slots[j], __ATOMIC_RELEASE);
+        i = j;
+    }
+    __atomic_store_n(&idx->slots[i], NULL, __ATOMIC_RELEASE);
+    s->nentries--;
+}
+
+// 리스트에서 항목을 뺌. 리스트가 속한 샤드의 잠금을 잡은 상태에서 호출함
+static void lru_unlink(cache_lru *l, cache_block *b)
+{
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        l->head = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    else
+        l->tail = b->prev;
+}
+
+// 항목을 리스트의 맨 앞(가장 최근)에 넣음. 리스트가 속한 샤드의 잠금을 잡은 상태에서 호출함
+static void lru_push_front(Cache *c, cache_lru *l, cache_block *b)
+{
+    b->atime = __atomic_add_fetch(&c->clock, 1, __ATOMIC_RELAXED);
+    b->prev = NULL;
+    b->next = l->head;
+    if (l->head)
+        l->head->prev = b;
+    else
+        l->tail = b;
+    l->head = b;
+}
+
+static int region_nitems(cache_region *r)
+{
+    return r->list[0].nitems + r->list[1].nitems;
+}
+
+// 영역의 list[i] 맨 앞에 넣음
+static void region_push(Cache *c, cache_region *r, int i, cache_block *b)
+{
+    b->list = i;
+    lru_push_front(c, &r->list[i], b);
+    __atomic_add_fetch(&r->list[i].nitems, 1, __ATOMIC_RELAXED);
+}
+
+static void region_remove(cache_region *r, cache_block *b)
+{
+    lru_unlink(&r->list[b->list], b);
+    __atomic_sub_fetch(&r->list[b->list].nitems, 1, __ATOMIC_RELAXED);
+}
+
+// 영역 안에서 list[i]의 맨 앞으로 옮김
+static void region_move(Cache *c, cache_region *r, int i, cache_block *b)
+{
+    region_remove(r, b);
+    region_push(c, r, i, b);
+}
+
+// 차출한 항목의 해시를 기억함. ghost 크기는 샤드 예산에 들어가는 이 클래스 항목 수
+static void ghost_add(Cache *c, cache_ghost *g, cache_block *b)
+{
+    if (g->hashes == NULL)
+    {
+        g->size = c->share / c->classes[b->cls].size + 1;
+        g->hashes = Calloc(g->size, sizeof(uint64_t));
+    }
+    if (g->hashes[g->head])
+        g->count--;
+    g->hashes[g->head] = b->hash;
+    g->head = (g->head + 1) % g->size;
+    g->count++;
+}
+
+// ghost에 hash가 있으면 지우고 1을 리턴함
+static int ghost_take(cache_ghost *g, uint64_t hash)
+{
+    int i;
+
+    for (i = 0; i < g->size; i = i + 1)
+        if (g->hashes[i] == hash)
+        {
+            g->hashes[i] = 0;
+            g->count--;
+            return 1;
+        }
+    return 0;
+}
+
+// LRU와 CLOCK은 list[0] 하나만 씀
+static void list0_link(Cache *c, cache_region *r, cache_block *b)
+{
+    region_push(c, r, 0, b);
+}
+
+static void plain_unlink(Cache *c, cache_region *r, cache_block *b)
+{
+    region_remove(r, b);
+}
+
+// LRU와 ARC의 히트는 항목을 영역의 리스트 i 앞으로 옮겨야 하므로 항목이 속한 샤드의 잠금을 잡음. 다른 스레드가 잡고
+// 있으면 기다리지 않고 referenced만 남겨 두고, 차출할 차례에 그 항목을 만나면 마저 옮김. refcnt를 가진 채 부르므로
+// chunk는 그대로지만, 그 사이 차출되었거나 아직 윈도에 있으면 옮기지 않음
+static void region_hit(Cache *c, cache_block *b, int i)
+{
+    cache_shard *s = cache_shard_of(c, b->hash);
+
+    if (sem_trywait(&s->mutex) < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            unix_error("sem_trywait error");
+        if (!__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&b->referenced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (b->state == CHUNK_LINKED && b->list != CACHE_WINDOW)
+    {
+        __atomic_store_n(&b->referenced, 0, __ATOMIC_RELAXED);
+        region_move(c, &s->region[b->cls], i, b);
+    }
+    V(&s->mutex);
+}
+
+static void lru_hit(Cache *c, cache_block *b)
+{
+    region_hit(c, b, 0);
+}
+
+static void clock_hit(Cache *c, cache_block *b)
+{
+    if (!__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&b->referenced, 1, __ATOMIC_RELAXED);
+}
+
+// 리스트 끝에서부터 히트한 적 있는 항목은 표시를 지우고 앞으로 옮기며 넘기고, 처음 만난 나머지 항목을 고름
+static cache_block *clock_victim(Cache *c, cache_region *r)
+{
+    cache_lru *l = &r->list[0];
+    cache_block *b;
+
+    for (b = l->tail; b && b != l->head && __atomic_load_n(&b->referenced, __ATOMIC_RELAXED); b = l->tail)
+    {
+        __atomic_store_n(&b->referenced, 0, __ATOMIC_RELAXED);
+        lru_unlink(l, b);
+        lru_push_front(c, l, b);
+    }
+    return b;
+}
+
+// 끝 항목을 고름. 잠금을 얻지 못해 옮기지 못한 히트가 남은 항목은 CLOCK처럼 앞으로 옮기고 넘어감
+static cache_block *lru_victim(Cache *c, cache_region *r)
+{
+    return clock_victim(c, r);
+}
+
+// S3-FIFO. 새 항목은 작은 FIFO(list[0])에 넣고, ghost에 남아 있던 uri면 곧바로 본 FIFO(list[1])에 넣음
+static void s3fifo_link(Cache *c, cache_region *r, cache_block *b)
+{
+    region_push(c, r, ghost_take(&r->ghost[0], b->hash) ? 1 : 0, b);
+}
+
+// 작은 FIFO에서 차출하는 항목은 ghost에 남김
+static void s3fifo_unlink(Cache *c, cache_region *r, cache_block *b)
+{
+    if (b->list == 0)
+        ghost_add(c, &r->ghost[0], b);
+    region_remove(r, b);
+}
+
+static void s3fifo_hit(Cache *c, cache_block *b)
+{
+    if (__atomic_load_n(&b->referenced, __ATOMIC_RELAXED) < S3FIFO_FREQ_MAX)
+        __atomic_add_fetch(&b->referenced, 1, __ATOMIC_RELAXED);
+}
+
+// 작은 FIFO가 제 몫을 넘었으면 그 끝에서, 아니면 본 FIFO 끝에서 고름. 작은 FIFO에 있는 동안 히트한 항목은 본 FIFO로
+// 올리고, 본 FIFO에서 히트한 항목은 히트 수를 하나 줄여 앞으로 다시 넣으며 넘김
+static cache_block *s3fifo_victim(Cache *c, cache_region *r)
+{
+    cache_block *b;
+    int small;
+
+    while (1)
+    {
+        small = region_nitems(r) * S3FIFO_SMALL_PCT / 100;
+        if ((b = r->list[0].tail) != NULL && (r->list[0].nitems > small || !r->list[1].tail))
+        {
+            if (!__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+                return b;
+            __atomic_store_n(&b->referenced, 0, __ATOMIC_RELAXED);
+            region_move(c, r, 1, b);
+            continue;
+        }
+        if ((b = r->list[1].tail) == NULL || !__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+            return b;
+        __atomic_sub_fetch(&b->referenced, 1, __ATOMIC_RELAXED);
+        region_move(c, r, 1, b);
+    }
+}
+
+// ARC. ghost B1에 있던 uri가 다시 들어오면 T1의 몫을, B2에 있던 uri면 T2의 몫을 늘리고 T2에 넣음
+static void arc_link(Cache *c, cache_region *r, cache_block *b)
+{
+    int b1 = r->ghost[0].count, b2 = r->ghost[1].count, n = region_nitems(r) + 1;
+
+    if (b1 > 0 && ghost_take(&r->ghost[0], b->hash))
+    {
+        r->target += b2 > b1 ? b2 / b1 : 1;
+        if (r->target > n)
+            r->target = n;
+        region_push(c, r, 1, b);
+    }
+    else if (b2 > 0 && ghost_take(&r->ghost[1], b->hash))
+    {
+        r->target -= b1 > b2 ? b1 / b2 : 1;
+        if (r->target < 0)
+            r->target = 0;
+        region_push(c, r, 1, b);
+    }
+    else
+        region_push(c, r, 0, b);
+}
+
+static void arc_unlink(Cache *c, cache_region *r, cache_block *b)
+{
+    ghost_add(c, &r->ghost[b->list], b);
+    region_remove(r, b);
+}
+
+static void arc_hit(Cache *c, cache_block *b)
+{
+    region_hit(c, b, 1);
+}
+
+// T1이 목표보다 많으면 T1의 끝에서, 아니면 T2의 끝에서 고름. 옮기지 못한 히트가 남은 항목은 T2 앞으로 옮기고 다시 고름
+static cache_block *arc_victim(Cache *c, cache_region *r)
+{
+    cache_block *b;
+
+    while (1)
+    {
+        if (r->list[0].tail && (r->list[0].nitems > r->target || !r->list[1].tail))
+            b = r->list[0].tail;
+        else
+            b = r->list[1].tail;
+        if (b == NULL || !__atomic_load_n(&b->referenced, __ATOMIC_RELAXED))
+            return b;
+        __atomic_store_n(&b->referenced, 0, __ATOMIC_RELAXED);
+        region_move(c, r, 1, b);
+    }
+}
+
+const cache_policy cache_policies[POLICY_COUNT] = {
+    {"lru", list0_link, plain_unlink, lru_hit, lru_victim},
+    {"clock", list0_link, plain_unlink, clock_hit, clock_victim},
+    {"s3fifo", s3fifo_link, s3fifo_unlink, s3fifo_hit, s3fifo_victim},
+    {"arc", arc_link, arc_unlink, arc_hit, arc_victim},
+};
+
+// 항목을 샤드 인덱스와 정책 영역(또는 윈도)에서 빼고 CHUNK_RETIRED로 바꿈. 이미 찾아 간 독자는 그대로 응답을 보냄.
+// 호출자는 c->mutex를 잡고 slab_retire로 넘겨야 함. 항목이 속한 샤드의 잠금을 잡은 상태에서 호출함
+static void cache_unlink(Cache *c, cache_block *b)
+{
+    cache_shard *s = cache_shard_of(c, b->hash);
+    cache_region *r = &s->region[b->cls];
+    slab_class *sc = &c->classes[b->cls];
+
+    index_remove(s, b);
+    if (b->list == CACHE_WINDOW)
+    {
+        lru_unlink(&r->window, b);
+        __atomic_sub_fetch(&r->window.nitems, 1, __ATOMIC_RELAXED);
+    }
+    else
+        c->policy->unlink(c, r, b);
+    __atomic_sub_fetch(&s->used, sc->size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&sc->nitems, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->used, sc->size, __ATOMIC_RELAXED);
+    b->state = CHUNK_RETIRED;
+    b->epoch = epoch_retire(c);
+}
+
+// 영역의 윈도가 가질 항목 수. 윈도를 포함한 영역 항목의 CACHE_WINDOW_PCT%이고 최소 1개
+static int window_target(cache_region *r)
+{
+    int n = (region_nitems(r) + r->window.nitems) * CACHE_WINDOW_PCT / 100;
+
+    return n > 1 ? n : 1;
+}
+
+// 윈도의 항목을 같은 영역의 정책 리스트로 옮김. 영역이 속한 샤드의 잠금을 잡은 상태에서 호출함
+static void window_promote(Cache *c, cache_region *r, cache_block *b)
+{
+    lru_unlink(&r->window, b);
+    __atomic_sub_fetch(&r->window.nitems, 1, __ATOMIC_RELAXED);
+    c->policy->link(c, r, b);
+}
+
+// 샤드 s의 클래스 cls 영역에 든 항목 수. window가 1이면 윈도의 항목도 셈. s->mutex 없이 읽으면 어림값임
+static int shard_nitems(cache_shard *s, int cls, int window)
+{
+    cache_region *r = &s->region[cls];
+
+    return __atomic_load_n(&r->list[0].nitems, __ATOMIC_RELAXED) + __atomic_load_n(&r->list[1].nitems, __ATOMIC_RELAXED) +
+           (window ? __atomic_load_n(&r->window.nitems, __ATOMIC_RELAXED) : 0);
+}
+
+// 클래스 cls의 항목을 차출할 샤드를 고름. 항목을 넣을 샤드 home이 자기 예산을 다 썼고 영역에 이 클래스 항목이 있으면
+// home을, 아니면 영역에 이 클래스 항목을 가진 샤드 가운데 가장 많이 쓴 샤드를 고름. 그런 샤드가 없을 때만 윈도에만
+// 항목이 있는 샤드를 고름. 샤드 잠금 없이 읽은 값으로 고르므로, 잠금을 잡은 뒤 cache_victim이 항목을 찾지 못할 수도
+// 있음. 항목을 가진 샤드가 없으면 NULL
+static cache_shard *cache_victim_shard(Cache *c, int cls, cache_shard *home)
+{
+    cache_shard *s = NULL;
+    size_t used, max = 0;
+    int i, window;
+
+    if (shard_nitems(home, cls, 0) > 0 && __atomic_load_n(&home->used, __ATOMIC_RELAXED) >= c->share)
+        return home;
+    for (window = 0; window < 2 && !s; window = window + 1)
+        for (i = 0; i < c->nshards; i = i + 1)
+        {
+            used = __atomic_load_n(&c->shards[i].used, __ATOMIC_RELAXED);
+            if (shard_nitems(&c->shards[i], cls, window) > 0 && (!s || used > max))
+            {
+                s = &c->shards[i];
+                max = used;
+            }
+        }
+    return s;
+}
+
+// 샤드 s의 클래스 cls에서 차출할 항목을 고름. 차출 정책으로 영역에서 희생 후보를 고르고, 윈도가 제 몫을 채웠으면
+// 새 항목이 들어올 자리를 위해 윈도의 끝 항목이 밀려나는데, 이 항목의 빈도 어림값이 희생 후보보다 크면 영역으로 옮기고
+// 희생 후보를, 아니면 밀려난 항목을 리턴함. 항목이 없으면 NULL. s->mutex를 잡은 상태에서 호출함
+static cache_block *cache_victim(Cache *c, int cls, cache_shard *s)
+{
+    cache_region *r = &s->region[cls];
+    cache_block *b = NULL, *cand = NULL;
+
+    if (region_nitems(r) > 0)
+        b = c->policy->victim(c, r);
+    if (r->window.tail && (!b || r->window.nitems >= window_target(r)))
+        cand = r->window.tail;
+    if (!cand || !b)
+        return cand ? cand : b;
+    if (sketch_estimate(&c->sketch, cand->hash) <= sketch_estimate(&c->sketch, b->hash))
+    {
+        __atomic_add_fetch(&c->rejected, 1, __ATOMIC_RELAXED);
+        return cand;
+    }
+    window_promote(c, r, cand);
+    __atomic_add_fetch(&c->admitted, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+// 클래스 cls의 항목 하나를 차출해 CHUNK_RETIRED로 리턴함. cache_victim_shard가 고른 샤드의 잠금만 잡았다 놓으므로
+// 잠금을 잡지 않은 상태에서 부르고, 호출자는 slab_release를 거쳐 c->mutex를 잡고 slab_retire로 넘김. 없으면 NULL
+static cache_block *cache_evict(Cache *c, int cls, cache_shard *home)
+{
+    cache_shard *s;
+    cache_block *b;
+
+    if ((s = cache_victim_shard(c, cls, home)) == NULL)
+        return NULL;
+    P(&s->mutex);
+    if ((b = cache_victim(c, cls, s)) != NULL)
+    {
+        cache_unlink(c, b);
+        b->next = NULL;
+    }
+    V(&s->mutex);
+    return b;
+}
+
+// 모든 샤드의 잠금을 번호 순서로 잡고 c->mutex를 잡음. 여러 샤드의 항목을 한꺼번에 보거나 빼는 페이지 이동과
+// 통계, 스냅샷에서 씀
+static void cache_lock_all(Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->nshards; i = i + 1)
+        P(&c->shards[i].mutex);
+    P(&c->mutex);
+}
+
+static void cache_unlock_all(Cache *c)
+{
+    int i;
+
+    V(&c->mutex);
+    for (i = c->nshards - 1; i >= 0; i = i - 1)
+        V(&c->shards[i].mutex);
+}
+
+// 클래스 cls의 모든 샤드 항목 가운데 가장 오래전에 리스트에 넣은 것. 없으면 NULL. cache_lock_all로 잠근 상태에서 호출함
+static cache_block *cache_oldest(Cache *c, int cls)
+{
+    cache_region *r;
+    cache_block *b, *oldest = NULL;
+    int i, j;
+
+    for (i = 0; i < c->nshards; i = i + 1)
+    {
+        r = &c->shards[i].region[cls];
+        for (j = 0; j < 3; j = j + 1)
+            if ((b = (j < 2 ? r->list[j] : r->window).tail) != NULL && (!oldest || b->atime < oldest->atime))
+                oldest = b;
+    }
+    return oldest;
+}
+
+// need 바이트가 들어가는 가장 작은 클래스. 페이지보다 크면 -1
+static int slab_clsid(Cache *c, size_t need)
+{
+    int i;
+
+    for (i = 0; i < c->nclasses; i = i + 1)
+        if (c->classes[i].size >= need)
+            return i;
+    return -1;
+}
+
+// 페이지 page를 클래스 cls에 배정하고 chunk로 잘라 빈 목록에 넣음. c->mutex를 잡은 상태에서 호출함
+static void slab_carve(Cache *c, int page, int cls)
+{
+    slab_class *sc = &c->classes[cls];
+    char *base = c->arena + (size_t)page * c->page_size;
+    cache_block *b;
+    int i;
+
+    c->page_class[page] = cls;
+    sc->npages++;
+    for (i = sc->perpage - 1; i >= 0; i = i - 1)
+    {
+        b = (cache_block *)(base + (size_t)i * sc->size);
+        b->cls = cls;
+        b->state = CHUNK_FREE;
+        b->refcnt = 0;
+        b->next = sc->freelist;
+        sc->freelist = b;
+    }
+}
+
+
+// chunk를 클래스의 빈 목록에 돌려줌. c->mutex를 잡은 상태에서 호출함
+static void slab_free(Cache *c, cache_block *b)
+{
+    slab_class *sc = &c->classes[b->cls];
+
+    b->state = CHUNK_FREE;
+    b->next = sc->freelist;
+    sc->freelist = b;
+}
+
+// cache_unlink로 뺀 chunk를 회수 대기 목록에 넣음. 독자가 모두 끝나고 인덱스를 읽던 스레드가 모두 빠져나오면
+// slab_reclaim이 빈 목록으로 옮김. c->mutex를 잡은 상태에서 호출함
+static void slab_retire(Cache *c, cache_block *b)
+{
+    slab_class *sc = &c->classes[b->cls];
+
+    b->next = sc->retired;
+    sc->retired = b;
+}
+
+// 회수 대기 목록에서 마지막 독자가 readend를 불렀고 oldest(epoch_oldest) 전에 뺀 chunk를 빈 목록으로 옮김.
+// c->mutex를 잡은 상태에서 호출함
+static void slab_reclaim(Cache *c, slab_class *sc, unsigned long oldest)
+{
+    cache_block **pp = &sc->retired, *b;
+
+    while ((b = *pp) != NULL)
+    {
+        if (b->epoch < oldest && __atomic_load_n(&b->refcnt, __ATOMIC_ACQUIRE) == 0)
+        {
+            *pp = b->next;
+            slab_free(c, b);
+        }
+        else
+            pp = &b->next;
+    }
+}
+
+// 클래스 cls의 chunk 하나를 얻어 CHUNK_RESERVED로 리턴함. 빈 chunk, 아직 배정하지 않은 페이지,
+// 회수할 수 있게 된 차출 chunk 순으로 시도하고, 모두 없으면 NULL. 호출자는 c->mutex를 놓고 cache_evict로 항목 하나를
+// 차출한 뒤 다시 부름. oldest는 호출자가 잠금 밖에서 구한 epoch_oldest. c->mutex를 잡은 상태에서 호출함
+#define SLAB_EVICT_TRIES 8
+static cache_block *slab_alloc(Cache *c, int cls, unsigned long oldest)
+{
+    slab_class *sc = &c->classes[cls];
+    cache_block *b;
+
+    if (!sc->freelist && c->pages_used < c->npages)
+        slab_carve(c, c->pages_used++, cls);
+    if (!sc->freelist)
+        slab_reclaim(c, sc, oldest);
+    if ((b = sc->freelist) != NULL)
+    {
+        sc->freelist = b->next;
+        b->state = CHUNK_RESERVED;
+        return b;
+    }
+    return NULL;
+}
+
+// 페이지를 비울 때 잃게 되는 항목들이 얼마나 식었는지를 나타내는 값으로, 페이지에 든 항목들의 atime 평균.
+// 빈 chunk는 0으로, 히트한 뒤 아직 LRU 리스트 앞으로 옮기지 않은 항목은 지금 시각으로 셈.
+// 채우거나 회수하는 중이거나 보내는 중인 chunk가 있어 비울 수 없으면 ULONG_MAX. cache_lock_all로 잠근 상태에서 호출함
+static unsigned long slab_page_age(Cache *c, int page)
+{
+    slab_class *sc = &c->classes[c->page_class[page]];
+    char *base = c->arena + (size_t)page * c->page_size;
+    unsigned long sum = 0;
+    cache_block *b;
+    int i;
+
+    for (i = 0; i < sc->perpage; i = i + 1)
+    {
+        b = (cache_block *)(base + (size_t)i * sc->size);
+        if (b->state == CHUNK_RESERVED || b->state == CHUNK_RETIRED ||
+            (b->state == CHUNK_LINKED && __atomic_load_n(&b->refcnt, __ATOMIC_ACQUIRE) > 0))
+            return ULONG_MAX;
+        if (b->state == CHUNK_LINKED)
+            sum += (__atomic_load_n(&b->referenced, __ATOMIC_RELAXED) ? c->clock : b->atime) / sc->perpage;
+    }
+    return sum;
+}
+
+// 다른 클래스의 페이지 하나를 비워 클래스 cls에 넘겨줌. 페이지를 가진 각 클래스에서 가장 오래된 항목이 든 페이지
+// (항목이 없는 클래스는 아무 페이지)를 후보로 두고, slab_page_age가 before보다 작은 후보 가운데 가장 식은 페이지를 고름.
+// 한 페이지의 항목은 LRU 순서와 무관하게 섞여 있으므로, 평균으로 비교해야 자주 쓰는 항목이 많은 페이지를 내주지 않음.
+// 페이지의 빈 chunk는 빈 목록에서 빼고 항목은 모두 차출해, 페이지의 chunk 전부를 next로 이어 *chunks에 두고
+// 페이지 번호를 리턴함. 페이지는 어느 클래스에도 속하지 않은 채로 두므로 다른 스레드가 건드리지 않음. 호출자는
+// 잠금을 모두 놓고 slab_release로 인덱스를 읽던 스레드를 기다린 뒤 c->mutex를 잡고 slab_take_page로 마무리함.
+// 옮길 페이지가 없으면 -1. oldest는 epoch_oldest. 여러 샤드의 항목을 빼므로 cache_lock_all로 잠근 상태에서 호출함
+static int slab_move_page(Cache *c, int cls, unsigned long before, unsigned long oldest, cache_block **chunks)
+{
+    slab_class *from;
+    cache_block *b, **pp, *tail;
+    unsigned long age, coldest = before;
+    char *base;
+    int i, j, cand, page = -1;
+
+    for (i = 0; i < c->nclasses; i = i + 1)
+    {
+        // 페이지가 하나뿐인 클래스도 더 식었으면 내줌. 클래스 수가 페이지 수보다 많으므로, 마지막 페이지를 지키면
+        // 페이지를 먼저 받은 클래스들만 남고 나머지 클래스는 영영 chunk를 얻지 못함
+        if (i == cls || c->classes[i].npages < 1)
+            continue;
+        // 회수 대기 중인 chunk가 있는 페이지는 고르지 않으므로 먼저 회수함
+        slab_reclaim(c, &c->classes[i], oldest);
+        cand = -1;
+        if ((tail = cache_oldest(c, i)) != NULL)
+            cand = ((char *)tail - c->arena) / c->page_size;
+        else
+            for (j = 0; cand < 0 && j < c->pages_used; j = j + 1)
+                if (c->page_class[j] == i)
+                    cand = j;
+        if (cand >= 0 && (age = slab_page_age(c, cand)) < coldest)
+        {
+            coldest = age;
+            page = cand;
+        }
+    }
+    // 옮기지 못했어도 다시 살펴보는 것은 페이지 하나 분량을 더 차출한 뒤로 미룸
+    c->classes[cls].pressure = 0;
+    if (page < 0)
+        return -1;
+    from = &c->classes[c->page_class[page]];
+
+    // 빈 chunk는 빈 목록에서 빼고, 항목은 차출함. 페이지를 고른 slab_page_age가 회수 대기 chunk나 채우는 중인 chunk가
+    // 없음을 확인했으므로 페이지의 chunk는 이 둘 가운데 하나임
+    base = c->arena + (size_t)page * c->page_size;
+    for (pp = &from->freelist; *pp;)
+    {
+        if ((char *)*pp >= base && (char *)*pp < base + c->page_size)
+            *pp = (*pp)->next;
+        else
+            pp = &(*pp)->next;
+    }
+    *chunks = NULL;
+    for (i = 0; i < from->perpage; i = i + 1)
+    {
+        b = (cache_block *)(base + (size_t)i * from->size);
+        if (b->state == CHUNK_LINKED)
+        {
+            cache_unlink(c, b);
+            from->evictions++;
+        }
+        b->next = *chunks;
+        *chunks = b;
+    }
+    from->npages--;
+    c->page_class[page] = -1;
+    return page;
+}
+
+// slab_move_page로 비운 페이지를 slab_release가 인덱스를 읽던 스레드를 모두 기다린 뒤에 마무리함. 그 사이 독자가 생긴
+// chunk가 없으면 1을 리턴하고, 호출자는 slab_carve로 페이지를 배정함. 있으면 페이지를 원래 클래스 from에 돌려주고
+// chunk들을 빈 목록이나 회수 대기 목록에 넣은 뒤 0을 리턴함. c->mutex를 잡은 상태에서 호출함
+static int slab_take_page(Cache *c, int page, int from, cache_block *chunks)
+{
+    cache_block *b;
+    int busy = 0;
+
+    for (b = chunks; b; b = b->next)
+        if (__atomic_load_n(&b->refcnt, __ATOMIC_ACQUIRE) > 0)
+            busy = 1;
+    if (!busy)
+    {
+        c->rebalances++;
+        return 1;
+    }
+    // slab_page_age로 고른 뒤 차출하기 전에 찾아 간 독자가 있음. 페이지는 그대로 두고 chunk만 돌려줌
+    c->page_class[page] = from;
+    c->classes[from].npages++;
+    while ((b = chunks) != NULL)
+    {
+        chunks = b->next;
+        if (b->state == CHUNK_RETIRED)
+            slab_retire(c, b);
+        else
+            slab_free(c, b);
+    }
+    return 0;
+}
+
+// cache_find가 찾은 만료된 항목을 캐시에서 빼고 놓음. 빼 두지 않으면 서버에서 새로 받은 응답을 cache_uri가
+// 같은 uri가 이미 있다며 저장하지 않음. refcnt를 잡은 채로 빼므로 그 사이 chunk가 다른 항목으로 다시 쓰이지 않음
+static void cache_expire(Cache *c, cache_block *b)
+{
+    cache_shard *s = cache_shard_of(c, b->hash);
+    int unlinked = 0;
+
+    P(&s->mutex);
+    if (b->state == CHUNK_LINKED)
+    {
+        cache_unlink(c, b);
+        unlinked = 1;
+    }
+    V(&s->mutex);
+    if (unlinked)
+    {
+        __atomic_add_fetch(&c->expired, 1, __ATOMIC_RELAXED);
+        P(&c->mutex);
+        slab_retire(c, b);
+        V(&c->mutex);
+    }
+    readend(b);
+}
+
+// 필요한 정보를 담은 캐시가 존재하는지 확인하고 있다면 항목을 리턴함.
+// uri는 uri_normalize로 정규화된 키이고, 찾은 항목은 refcnt를 올려 둔 채 리턴하므로 호출자가 다 보낸 뒤 readend를 불러야 함.
+// 히트는 잠금을 잡지 않음. count가 0이면 같은 요청으로 다시 확인하는 것이므로 빈도 스케치, 히트/미스 수,
+// 정책의 히트 처리를 건드리지 않고 찾기만 함
+cache_block *cache_find(Cache *c, char *uri, int count)
+{
+    uint64_t hash = hash64(uri, strlen(uri));
+    cache_block *b;
+
+    // epoch 안에서 찾은 항목은 그 사이 차출되더라도 이 스레드가 epoch_exit를 부를 때까지 slab_reclaim이 회수하지 않으므로,
+    // refcnt를 올리기 전에 chunk가 다시 쓰이는 일이 없음. refcnt를 올린 뒤에는 readend까지 chunk가 회수되지 않음.
+    // 히트를 정책에 알리는 일은 epoch 밖에서 함. CLOCK과 S3-FIFO는 referenced만 바꾸고, LRU와 ARC는 샤드 잠금을 얻을 수 있으면 잡음
+    if (count && c->admission)
+        sketch_add(&c->sketch, hash);
+    epoch_enter(c);
+    if ((b = index_lookup(cache_shard_of(c, hash), uri, hash)) != NULL)
+        __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+    epoch_exit(c);
+    if (b && b->expires && b->expires <= time(NULL))
+    {
+        cache_expire(c, b);
+        b = NULL;
+    }
+    if (!count)
+        return b;
+    if (b)
+    {
+        __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->hitbytes, b->size, __ATOMIC_RELAXED);
+        c->policy->hit(c, b);
+    }
+    else
+        __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+    // 캐시 미스일 경우 NULL, 캐시 히트일 경우 해당 항목 리턴
+    return b;
+}
+
+// cache_evict와 slab_move_page가 내놓은 chunk들을 잠금 없이 처리함. 차출한 항목은 디스크 캐시로 내려보낼 때(c->demote)
+// 여기서 쓰고, wait이면 그 항목들을 빼기 전부터 인덱스를 읽던 스레드가 빠져나오기를 기다림. chunk들은 어느 목록에도
+// 없으므로 호출자가 c->mutex를 잡고 넘길 때까지 다른 스레드가 쓰지 않고, 남은 독자는 그대로 읽을 수 있음.
+// 처리한 뒤 구한 epoch_oldest를 리턴함
+static unsigned long slab_release(Cache *c, cache_block *chunks, int wait)
+{
+    cache_block *b;
+    unsigned long epoch = 0;
+
+    for (b = chunks; b; b = b->next)
+    {
+        if (b->state != CHUNK_RETIRED)
+            continue;
+        if (c->demote)
+            disk_demote(b->cache_uri, b->cache_obj, b->size, b->hdrlen, b->expires);
+        if (b->epoch > epoch)
+            epoch = b->epoch;
+    }
+    if (wait && epoch)
+        epoch_wait(c, epoch);
+    return epoch_oldest(c);
+}
+
+// 저장할 응답에서 마지막 헤더 줄의 CRLF까지의 길이를 구함. 빈 줄이 없으면 0
+static size_t stored_hdrlen(char *buf, size_t size)
+{
+    char *p = memmem(buf, size, "\r\n\r\n", 4);
+    return p ? p - buf + 2 : 0;
+}
+
+// uri와 buf를 새 항목으로 저장함. expires는 응답의 만료 시각(0이면 만료 없음).
+// 항목이 들어갈 클래스의 chunk를 얻지 못하면 저장하지 않음
+void cache_uri(Cache *c, char *uri, char *buf, size_t size, time_t expires)
+{
+    uint64_t hash = hash64(uri, strlen(uri));
+    cache_shard *s = cache_shard_of(c, hash);
+    size_t urilen = strlen(uri) + 1;
+    cache_block *b, *oldest, *chunks;
+    cache_region *r;
+    unsigned long safe;
+    int cls, page = -1, from, tries, move, dup = 0;
+    slab_class *sc;
+
+    if ((cls = slab_clsid(c, sizeof(cache_block) + size + urilen)) < 0)
+        return;
+    sc = &c->classes[cls];
+    r = &s->region[cls];
+
+    // 다른 스레드가 같은 uri를 먼저 저장했으면 저장하지 않음
+    epoch_enter(c);
+    b = index_lookup(s, uri, hash);
+    epoch_exit(c);
+    if (b)
+        return;
+
+    // 차출해 둔 chunk를 회수해도 되는지는 잠금 밖에서 슬롯을 훑어 정함
+    safe = epoch_oldest(c);
+    // 페이지를 모두 배정한 뒤에는 클래스마다 받은 페이지 수가 고정되므로, 클래스 안에서 페이지 하나 분량을 차출할
+    // 때마다 자기 가장 오래된 항목보다 더 식은 페이지가 있으면 넘겨받음. 항목이 없는 클래스는 식은 정도와 상관없이 넘겨받음
+    P(&c->mutex);
+    b = slab_alloc(c, cls, safe);
+    move = !b && c->pages_used == c->npages &&
+           (__atomic_load_n(&sc->nitems, __ATOMIC_RELAXED) == 0 || sc->pressure >= (unsigned long)sc->perpage);
+    V(&c->mutex);
+    if (move)
+    {
+        // 페이지의 항목은 여러 샤드에 흩어져 있으므로 모든 샤드를 잠그고 고름
+        cache_lock_all(c);
+        oldest = cache_oldest(c, cls);
+        if (!sc->freelist && (!oldest || sc->pressure >= (unsigned long)sc->perpage))
+            page = slab_move_page(c, cls, oldest ? oldest->atime : ULONG_MAX, safe, &chunks);
+        cache_unlock_all(c);
+        // 페이지 전체를 새 클래스로 잘라 쓰므로 이 페이지에서 뺀 항목을 읽던 스레드는 잠금 밖에서 기다림.
+        // 옮기지 않았어도 잠금을 놓은 사이 다른 스레드가 돌려준 chunk가 있을 수 있으므로 다시 할당해 봄
+        if (page >= 0)
+        {
+            from = chunks->cls;
+            safe = slab_release(c, chunks, 1);
+        }
+        P(&c->mutex);
+        if (page >= 0 && slab_take_page(c, page, from, chunks))
+            slab_carve(c, page, cls);
+        b = slab_alloc(c, cls, safe);
+        V(&c->mutex);
+    }
+    // 빈 chunk가 없으면 cache_evict가 고른 샤드의 잠금만 잡고 항목 하나를 차출함. 잠금 밖에서 디스크 캐시로 내려보내고
+    // 읽던 스레드가 빠져나왔는지 다시 확인한 뒤 회수 대기 목록에 넣고 다시 할당함. 독자가 남아 있으면 다음 항목을 차출함
+    for (tries = 0; !b && tries < SLAB_EVICT_TRIES; tries = tries + 1)
+    {
+        if ((chunks = cache_evict(c, cls, s)) == NULL)
+            break;
+        safe = slab_release(c, chunks, 0);
+        P(&c->mutex);
+        sc->evictions++;
+        sc->pressure++;
+        slab_retire(c, chunks);
+        b = slab_alloc(c, cls, safe);
+        V(&c->mutex);
+    }
+    if (!b)
+        return;
+
+    // 항목은 chunk의 맨 앞에 놓고, 응답과 uri를 바로 뒤에 이어 붙임. 인덱스에 넣은 뒤로는 바꾸지 않음
+    b->cache_obj = (char *)(b + 1);
+    b->cache_uri = b->cache_obj + size;
+    memcpy(b->cache_obj, buf, size);
+    memcpy(b->cache_uri, uri, urilen);
+    b->size = size;
+    b->hdrlen = stored_hdrlen(buf, size);
+    b->hash = hash;
+    b->expires = expires;
+    b->referenced = 0;
+    b->refcnt = 0;
+
+    P(&s->mutex);
+    if (s->old_indexes)
+        index_reclaim(s, safe);
+    if (index_lookup(s, uri, hash) != NULL)
+        dup = 1;
+    else
+    {
+        b->state = CHUNK_LINKED;
+        index_insert(c, s, b);
+        // 새로 저장한 항목은 영역의 윈도에 넣고, 입장 제어를 쓰지 않으면 곧바로 정책 리스트에 넣음.
+        // 차출 없이 자리가 났으면 영역에 아직 여유가 있는 것이므로 윈도에서 넘친 항목은 그대로 정책 리스트로 옮김
+        if (c->admission)
+        {
+            b->list = CACHE_WINDOW;
+            lru_push_front(c, &r->window, b);
+            __atomic_add_fetch(&r->window.nitems, 1, __ATOMIC_RELAXED);
+        }
+        else
+            c->policy->link(c, r, b);
+        __atomic_add_fetch(&s->used, sc->size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sc->nitems, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->used, sc->size, __ATOMIC_RELAXED);
+        while (r->window.nitems > window_target(r))
+            window_promote(c, r, r->window.tail);
+        if (trace_fp)
+            fprintf(trace_fp, "SIZE %zu %s\n", size, uri);
+    }
+    V(&s->mutex);
+    if (dup)
+    {
+        P(&c->mutex);
+        slab_free(c, b);
+        V(&c->mutex);
+    }
+}
+
+// 캐시 사용량과 페이지가 배정된 클래스별 상태를 출력함
+void cache_stats(Cache *c, char *name)
+{
+    slab_class *sc;
+    cache_block *b;
+    int i, nentries = 0, nretired;
+    size_t maxused = 0;
+    unsigned long evictions = 0;
+
+    cache_lock_all(c);
+    for (i = 0; i < c->nshards; i = i + 1)
+    {
+        nentries += c->shards[i].nentries;
+        if (c->shards[i].used > maxused)
+            maxused = c->shards[i].used;
+    }
+    printf("%s: %d entries, %zu/%zu bytes in chunks, %d/%d pages, %lu page moves\n",
+           name, nentries, c->used, c->capacity, c->pages_used, c->npages, c->rebalances);
+    printf("  %d shards, %zu bytes each, fullest holds %zu\n", c->nshards, c->share, maxused);
+    for (i = 0; i < c->nclasses; i = i + 1)
+        evictions += c->classes[i].evictions;
+    printf("  policy %s: hits %lu, misses %lu (expired %lu), evictions %lu, hit bytes %lu\n", c->policy->name,
+           __atomic_load_n(&c->hits, __ATOMIC_RELAXED), __atomic_load_n(&c->misses, __ATOMIC_RELAXED), c->expired,
+           evictions, __atomic_load_n(&c->hitbytes, __ATOMIC_RELAXED));
+    if (c->admission)
+        printf("  admission: %lu admitted from window, %lu rejected\n", c->admitted, c->rejected);
+    for (i = 0; i < c->nclasses; i = i + 1)
+    {
+        sc = &c->classes[i];
+        for (nretired = 0, b = sc->retired; b; b = b->next)
+            nretired++;
+        if (sc->npages > 0 || sc->evictions > 0)
+            printf("  class %2d: chunk %6zu, pages %d, items %d, evictions %lu, still being sent %d\n",
+                   i, sc->size, sc->npages, sc->nitems, sc->evictions, nretired);
+    }
+    cache_unlock_all(c);
+    fflush(stdout);
+}
+
+// 벤치마크가 쓰는 단조 시계의 현재 시각 (초)
+static double bench_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 요청열을 모든 차출 정책에 대해 입장 제어를 끈 캐시와 켠 캐시로 한 번씩 재생하고, 캐시마다 cache_stats와 같은
+// 카운터(히트, 미스, 차출, 히트 바이트)를 출력함. uris[i]의 응답 길이는 sizes[i]이고, 미스면 그 길이로 저장함
+static void cache_replay(char **uris, size_t *sizes, int n)
+{
+    static char body[MAX_OBJECT_SIZE];
+    Cache c;
+    cache_block *b;
+    unsigned long evictions;
+    size_t bytes = 0;
+    int i, p, admission;
+
+    for (i = 0; i < n; i = i + 1)
+        bytes += sizes[i];
+    for (p = 0; p < POLICY_COUNT; p = p + 1)
+        for (admission = 0; admission < 2; admission = admission + 1)
+        {
+            cache_init(&c, MAX_CACHE_SIZE);
+            c.policy = &cache_policies[p];
+            c.admission = admission;
+            for (i = 0; i < n; i = i + 1)
+                if ((b = cache_find(&c, uris[i], 1)) != NULL)
+                    readend(b);
+                else
+                    cache_uri(&c, uris[i], body, sizes[i], 0);
+            for (evictions = 0, i = 0; i < c.nclasses; i = i + 1)
+                evictions += c.classes[i].evictions;
+            printf("%-6s %-9s hits %7lu, misses %7lu, hit ratio %5.2f%%, evictions %7lu, hit bytes %11lu (%5.2f%%)\n",
+                   c.policy->name, admission ? "+TinyLFU" : "", c.hits, c.misses, 100.0 * c.hits / n,
+                   evictions, c.hitbytes, 100.0 * c.hitbytes / bytes);
+            cache_free(&c);
+        }
+}
+
+// 재생 벤치마크 (-b). Zipf 분포로 고른 인기 객체 요청 사이사이에, 한 번만 쓰이는 uri를 잇달아 요청하는 훑기를
+// 끼워 넣은 요청열을 만들어 cache_replay로 재생함
+#define BENCH_OBJECTS 2000    // 인기 객체 수
+#define BENCH_REQUESTS 200000 // 인기 객체 요청 수
+#define BENCH_ZIPF 0.9        // Zipf 분포의 지수
+#define BENCH_SCAN_EVERY 5000 // 인기 객체 요청 이만큼마다 훑기를 한 번 끼워 넣음
+#define BENCH_SCAN_LEN 500    // 훑기 한 번에 요청하는 uri 수
+
+// 요청 id의 응답 길이. 인기 객체는 0 이상, 훑기 uri는 음수 id를 씀
+static size_t bench_size(long id)
+{
+    return 2000 + hash64(&id, sizeof(id)) % 30000;
+}
+
+static void bench_request(char **uris, size_t *sizes, int i, long id)
+{
+    char uri[MAXLINE];
+
+    snprintf(uri, MAXLINE, "http://bench.invalid/%s/%ld", id < 0 ? "scan" : "hot", id);
+    uris[i] = strdup(uri);
+    sizes[i] = bench_size(id);
+}
+
+// 항목 수에 따른 연산 비용. 정책마다 항목 수를 BENCH_COST_MIN부터 4배씩 BENCH_COST_MAX까지 늘리며, 차출 없이 다 들어가는
+// 캐시를 채우는 저장, 히트, 같은 수의 새 uri를 더 넣어 하나씩 차출하는 저장의 평균 시간을 잼. 히트는 항목 수와 상관없이
+// 앞의 BENCH_COST_MIN개를 고루 찾으므로, 읽는 메모리가 CPU 캐시를 넘어 느려지는 몫은 빼고 항목 수에 따른 비용만 보임
+#define BENCH_COST_MIN 1000
+#define BENCH_COST_MAX 64000
+#define BENCH_COST_SIZE 200 // 응답 길이. 모든 항목이 같은 클래스에 들어감
+static void bench_cost()
+{
+    static char body[BENCH_COST_SIZE];
+    char **uris = Malloc(2 * BENCH_COST_MAX * sizeof(char *)), uri[MAXLINE];
+    double start, insert, hit, evict;
+    cache_block *b;
+    Cache c;
+    int i, n, p, found;
+
+    for (i = 0; i < 2 * BENCH_COST_MAX; i = i + 1)
+    {
+        snprintf(uri, MAXLINE, "http://bench.invalid/cost/%d", i);
+        uris[i] = strdup(uri);
+    }
+    printf("cost per operation with %d byte responses as the cache grows:\n", BENCH_COST_SIZE);
+    for (p = 0; p < POLICY_COUNT; p = p + 1)
+        for (n = BENCH_COST_MIN; n <= BENCH_COST_MAX; n *= 4)
+        {
+            // 항목과 uri가 든 chunk는 응답 길이의 2배보다 작으므로, 페이지 단위로 내림해도 n개가 차출 없이 들어감
+            cache_init(&c, (size_t)n * 4 * BENCH_COST_SIZE);
+            c.policy = &cache_policies[p];
+            start = bench_seconds();
+            for (i = 0; i < n; i = i + 1)
+                cache_uri(&c, uris[i], body, BENCH_COST_SIZE, 0);
+            insert = bench_seconds() - start;
+            start = bench_seconds();
+            for (found = 0, i = 0; i < n; i = i + 1)
+                if ((b = cache_find(&c, uris[(size_t)i * 7919 % BENCH_COST_MIN], 1)) != NULL)
+                {
+                    readend(b);
+                    found++;
+                }
+            hit = bench_seconds() - start;
+            start = bench_seconds();
+            for (i = n; i < 2 * n; i = i + 1)
+                cache_uri(&c, uris[i], body, BENCH_COST_SIZE, 0);
+            evict = bench_seconds() - start;
+            printf("%-6s %6d entries: insert %6.0f ns, hit %6.0f ns (%d/%d found), insert with eviction %6.0f ns\n",
+                   c.policy->name, n, insert * 1e9 / n, hit * 1e9 / n, found, n, evict * 1e9 / n);
+            cache_free(&c);
+        }
+    for (i = 0; i < 2 * BENCH_COST_MAX; i = i + 1)
+        free(uris[i]);
+    Free(uris);
+}
+
+void cache_bench()
+{
+    int max = BENCH_REQUESTS + (BENCH_REQUESTS / BENCH_SCAN_EVERY) * BENCH_SCAN_LEN;
+    double *cdf = Malloc(BENCH_OBJECTS * sizeof(double)), sum = 0, u;
+    char **uris = Malloc(max * sizeof(char *));
+    size_t *sizes = Malloc(max * sizeof(size_t));
+    long scan = 0;
+    int i, j, n = 0, lo, hi;
+
+    for (i = 0; i < BENCH_OBJECTS; i = i + 1)
+        cdf[i] = sum += 1.0 / pow(i + 1, BENCH_ZIPF);
+    srand48(1);
+    for (i = 0; i < BENCH_REQUESTS; i = i + 1)
+    {
+        if (i > 0 && i % BENCH_SCAN_EVERY == 0)
+            for (j = 0; j < BENCH_SCAN_LEN; j = j + 1)
+                bench_request(uris, sizes, n++, --scan);
+        u = drand48() * sum;
+        for (lo = 0, hi = BENCH_OBJECTS - 1; lo < hi;)
+            if (cdf[(lo + hi) / 2] < u)
+                lo = (lo + hi) / 2 + 1;
+            else
+                hi = (lo + hi) / 2;
+        bench_request(uris, sizes, n++, lo);
+    }
+    printf("replaying %d requests: %d Zipf(%.1f) objects, a scan of %d one-time uris every %d requests, %d byte cache\n",
+           n, BENCH_OBJECTS, BENCH_ZIPF, BENCH_SCAN_LEN, BENCH_SCAN_EVERY, MAX_CACHE_SIZE);
+    cache_replay(uris, sizes, n);
+    for (i = 0; i < n; i = i + 1)
+        free(uris[i]);
+    Free(uris);
+    Free(sizes);
+    Free(cdf);
+    bench_cost();
+}
+
+// 요청 기록(-r)의 SIZE 줄 하나
+typedef struct
+{
+    uint64_t hash;
+    char *uri;
+    size_t size;
+} trace_size;
+
+static int trace_size_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((trace_size *)a)->hash, y = ((trace_size *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+// 기록한 요청열을 모든 정책으로 재생함 (-T). 한 번도 저장되지 않은 uri(큰 객체, 캐시할 수 없는 응답)의 요청은 뺌
+void cache_simulate(char *path)
+{
+    FILE *fp;
+    char line[MAXLINE + 64], uri[MAXLINE];
+    char **reqs = NULL, **uris;
+    trace_size *ts = NULL, key, *t;
+    size_t size, *sizes;
+    int nreqs = 0, maxreqs = 0, nsizes = 0, maxsizes = 0, n = 0, i;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error("cannot open trace");
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "GET %s", uri) == 1)
+        {
+            if (nreqs == maxreqs)
+                reqs = Realloc(reqs, (maxreqs = 2 * maxreqs + 1024) * sizeof(char *));
+            reqs[nreqs++] = strdup(uri);
+        }
+        else if (sscanf(line, "SIZE %zu %s", &size, uri) == 2)
+        {
+            if (nsizes == maxsizes)
+                ts = Realloc(ts, (maxsizes = 2 * maxsizes + 1024) * sizeof(trace_size));
+            ts[nsizes].hash = hash64(uri, strlen(uri));
+            ts[nsizes].uri = strdup(uri);
+            ts[nsizes].size = size;
+            nsizes++;
+        }
+    }
+    fclose(fp);
+
+    // 같은 uri가 여러 번 저장되었으면 처음 찾은 길이를 씀
+    qsort(ts, nsizes, sizeof(trace_size), trace_size_cmp);
+    uris = Malloc((nreqs + 1) * sizeof(char *));
+    sizes = Malloc((nreqs + 1) * sizeof(size_t));
+    for (i = 0; i < nreqs; i = i + 1)
+    {
+        key.hash = hash64(reqs[i], strlen(reqs[i]));
+        t = bsearch(&key, ts, nsizes, sizeof(trace_size), trace_size_cmp);
+        while (t && t > ts && t[-1].hash == key.hash)
+            t--;
+        for (; t && t < ts + nsizes && t->hash == key.hash; t++)
+            if (!strcmp(t->uri, reqs[i]))
+            {
+                uris[n] = reqs[i];
+                sizes[n++] = t->size;
+                break;
+            }
+    }
+    printf("replaying %d of %d requests in %s (%d never stored), %d byte cache\n",
+           n, nreqs, path, nreqs - n, MAX_CACHE_SIZE);
+    cache_replay(uris, sizes, n);
+    for (i = 0; i < nreqs; i = i + 1)
+        free(reqs[i]);
+    for (i = 0; i < nsizes; i = i + 1)
+        free(ts[i].uri);
+    free(reqs);
+    free(ts);
+    Free(uris);
+    Free(sizes);
+}
+
+// 슬랩 점검 (-C, make check). 기본 용량의 캐시와 샤드 모드(-s)의 샤드 하나가 받는 용량의 캐시마다, 용량이 예산을
+// 넘지 않는지와 모든 크기 클래스에 응답을 하나씩 저장해 바로 찾을 수 있는지 확인함. 클래스 수가 페이지 수보다 많으므로
+// 뒤의 클래스는 앞 클래스의 페이지를 넘겨받아야 저장됨. 모두 통과하면 0, 아니면 1을 리턴함
+#define CHECK_MAX_SHARDS 16
+int cache_check()
+{
+    static char body[MAX_OBJECT_SIZE];
+    char uri[MAXLINE];
+    Cache c;
+    cache_block *b;
+    size_t overhead, size;
+    int nshards, i, stored, failed = 0;
+
+    for (nshards = 1; nshards <= CHECK_MAX_SHARDS; nshards *= 2)
+    {
+        cache_init(&c, MAX_CACHE_SIZE / nshards);
+        if (c.capacity * nshards > MAX_CACHE_SIZE)
+        {
+            printf("%2d shard(s): %zu bytes each exceeds the %d byte budget\n", nshards, c.capacity, MAX_CACHE_SIZE);
+            failed = 1;
+        }
+        for (stored = 0, i = 0; i < c.nclasses; i = i + 1)
+        {
+            // 이 클래스에 들어가는 가장 큰 응답. 그 크기가 앞 클래스에도 들어가면 이 클래스를 쓰는 응답은 없음
+            sprintf(uri, "http://check/%d/%d", nshards, i);
+            overhead = sizeof(cache_block) + strlen(uri) + 1;
+            size = c.classes[i].size - overhead;
+            if (size >= MAX_OBJECT_SIZE)
+                size = MAX_OBJECT_SIZE - 1;
+            if (i > 0 && size + overhead <= c.classes[i - 1].size)
+                continue;
+            cache_uri(&c, uri, body, size, 0);
+            if ((b = cache_find(&c, uri, 1)) == NULL)
+            {
+                printf("%2d shard(s): class %d (chunk %zu) did not keep a %zu byte response\n",
+                       nshards, i, c.classes[i].size, size);
+                failed = 1;
+                continue;
+            }
+            readend(b);
+            stored++;
+        }
+        printf("%2d shard(s): %d pages of %zu bytes (%zu/%d), %d classes, %d responses stored and found, %lu page moves\n",
+               nshards, c.npages, c.page_size, c.capacity, MAX_CACHE_SIZE / nshards, c.nclasses, stored, c.rebalances);
+        cache_free(&c);
+    }
+    printf("%s\n", failed ? "FAIL" : "ok");
+    return failed;
+}
+
+// rio_readlineb 벤치마크 (-L). 브라우저가 보내는 것과 비슷한 요청 헤더 블록을 임시 파일에 RIO_BENCH_BLOCKS번 이어 쓰고,
+// 파일 전체를 줄 단위로 읽는 시간을 rio_readlineb와 한 바이트씩 읽는 예전 방식으로 RIO_BENCH_ROUNDS번씩 재서 비교함
+#define RIO_BENCH_BLOCKS 20000
+#define RIO_BENCH_ROUNDS 20
+static const char *rio_bench_header =
+    "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n"
+    "Host: www.cmu.edu\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.cmu.edu/\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1234567890; _gid=GA1.2.987654321.987654321\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// memchr로 바꾸기 전의 rio_readlineb. \n을 찾을 때까지 rio_readnb로 한 바이트씩 읽음
+static ssize_t rio_bench_bytewise(rio_t *rp, char *usrbuf, size_t maxlen)
+{
+    size_t n;
+    ssize_t rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++)
+    {
+        if ((rc = rio_readnb(rp, &c, 1)) == 1)
+        {
+            *bufp++ = c;
+            if (c == '\n')
+            {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0)
+        {
+            if (n == 1)
+                return 0;
+            break;
+        }
+        else
+            return -1;
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+void rio_bench()
+{
+    char path[] = "/tmp/rio_benchXXXXXX", line[MAXLINE];
+    const char *names[2] = {"byte at a time", "rio_readlineb"};
+    size_t len = strlen(rio_bench_header), bytes;
+    double start, elapsed[2];
+    long lines[2];
+    rio_t rio;
+    int fd, i, m;
+
+    if ((fd = mkstemp(path)) < 0)
+        unix_error("mkstemp error");
+    unlink(path);
+    for (i = 0; i < RIO_BENCH_BLOCKS; i = i + 1)
+        Rio_writen(fd, (void *)rio_bench_header, len);
+    bytes = len * RIO_BENCH_BLOCKS;
+    for (m = 0; m < 2; m = m + 1)
+    {
+        lines[m] = 0;
+        start = bench_seconds();
+        for (i = 0; i < RIO_BENCH_ROUNDS; i = i + 1)
+        {
+            Lseek(fd, 0, SEEK_SET);
+            Rio_readinitb(&rio, fd);
+            while ((m == 0 ? rio_bench_bytewise(&rio, line, MAXLINE) : rio_readlineb(&rio, line, MAXLINE)) > 0)
+                lines[m]++;
+        }
+        elapsed[m] = bench_seconds() - start;
+    }
+    Close(fd);
+    printf("reading a %zu byte header block of %ld lines %d times, %d rounds\n",
+           len, lines[1] / RIO_BENCH_BLOCKS / RIO_BENCH_ROUNDS, RIO_BENCH_BLOCKS, RIO_BENCH_ROUNDS);
+    for (m = 0; m < 2; m = m + 1)
+        printf("%-15s %8.1f ns/line %8.1f MB/s%s\n", names[m], elapsed[m] * 1e9 / lines[m],
+               bytes * RIO_BENCH_ROUNDS / elapsed[m] / 1e6, lines[m] == lines[1] ? "" : " (line count differs)");
+    printf("speedup %.1fx\n", elapsed[0] / elapsed[1]);
+}
+
+// 연결이 끊긴 클라이언트에게 쓰더라도 프로세스가 종료되지 않도록 Rio_writen 대신 사용함
+static int client_write(int fd, void *buf, size_t n)
+{
+    return rio_writen(fd, buf, n) == (ssize_t)n;
+}
+
+// iov 전체를 보낼 때까지 writev를 반복함
+static int client_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    while (iovcnt > 0)
+    {
+        if ((n = writev(fd, iov, iovcnt)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+// 저장된 응답을 보냄. 헤더와 본문 사이에 Connection 줄과 빈 줄을 끼워 writev 한 번으로 보냄.
+// 저장된 응답은 홉별 헤더를 뺀 채로 있으므로 클라이언트가 연결 유지 여부를 알 수 있도록 여기서 붙임
+static int send_stored(int fd, char *obj, size_t size, size_t hdrlen, int keepalive)
+{
+    struct iovec iov[3];
+    char *conn = keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    if (hdrlen == 0)
+        return client_write(fd, obj, size);
+    iov[0].iov_base = obj;
+    iov[0].iov_len = hdrlen;
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    iov[2].iov_base = obj + hdrlen + 2;
+    iov[2].iov_len = size - hdrlen - 2;
+    return client_writev(fd, iov, 3);
+}
+
+/*
+ * 큰 객체 캐시 (스레드 풀 모드)
+ * MAX_OBJECT_SIZE 이상이고 길이를 미리 아는 200 응답은 슬랩 캐시 대신 LARGE_SEGMENT_SIZE 크기 세그먼트의 사슬로 저장함.
+ * 작은 객체와 예산을 따로 두어 큰 객체 하나가 작은 객체들을 밀어내지 않게 하고, 예산 안에서는 GreedyDual-Size로
+ * 세그먼트 수가 많고 오래 쓰이지 않은 항목부터 차출함. Range 요청에는 해당 구간의 세그먼트만 보냄.
+ */
+#define LARGE_SEGMENT_SIZE (64 * 1024)
+#define LARGE_CACHE_SIZE (64 * 1024 * 1024) // 큰 객체 캐시의 바이트 예산
+#define LARGE_OBJECT_MAX (16 * 1024 * 1024) // 이보다 긴 본문은 캐시하지 않음
+#define LARGE_MAX_SEGS (LARGE_OBJECT_MAX / LARGE_SEGMENT_SIZE)
+#define LARGE_NBUCKETS 256
+
+typedef struct large_obj
+{
+    char uri[MAXLINE];
+    uint64_t hash;
+    char *hdr;               // 캐시에 저장할 형태의 헤더 (상태줄부터, 끝의 빈 줄은 빼고)
+    size_t hdrlen;
+    size_t size;             // 본문 길이
+    time_t expires;          // 이 시각부터는 미스로 처리함. 0이면 만료되지 않음
+    int nsegs;
+    char **segs;             // 본문 세그먼트. fetcher가 채우는 동안 필요할 때 하나씩 할당함
+    double priority;         // GreedyDual-Size 우선순위. 차출할 때 가장 작은 항목을 고름
+    unsigned long atime;     // 우선순위가 같으면 이 값이 작은(오래 쓰이지 않은) 항목을 먼저 차출함
+    int refcnt;              // 캐시, fetcher, fill, 보내는 중인 독자의 참조 수. 0이 되면 해제함
+    int linked;              // 캐시에 들어 있으면 1
+    struct large_obj *next;  // 같은 버킷의 다음 항목
+} large_obj;
+
+typedef struct
+{
+    large_obj *buckets[LARGE_NBUCKETS];
+    int nentries;
+    size_t capacity;
+    size_t used;             // 캐시에 든 항목들의 헤더와 세그먼트 크기 합
+    double inflation;        // GreedyDual-Size의 L. 마지막으로 차출한 항목의 우선순위
+    unsigned long clock;     // 항목을 넣거나 히트할 때마다 1씩 늘어나는 논리 시각
+    sem_t mutex;             // 버킷, 참조 수, 우선순위, 통계 보호
+    unsigned long hits, range_hits, stored, evictions, rejected, expired;
+} large_cache;
+
+large_cache large;
+
+void large_init()
+{
+    memset(&large, 0, sizeof(large_cache));
+    large.capacity = LARGE_CACHE_SIZE;
+    Sem_init(&large.mutex, 0, 1);
+}
+
+static size_t large_cost(large_obj *o)
+{
+    return o->hdrlen + (size_t)o->nsegs * LARGE_SEGMENT_SIZE;
+}
+
+// 세그먼트 수가 적은 항목일수록 같은 시점에 높은 우선순위를 받음. large.mutex를 잡은 상태에서 호출함
+static void large_touch(large_obj *o)
+{
+    o->priority = large.inflation + 1.0 / o->nsegs;
+    o->atime = ++large.clock;
+}
+
+static void large_free(large_obj *o)
+{
+    int i;
+
+    for (i = 0; i < o->nsegs; i = i + 1)
+        if (o->segs[i])
+            Free(o->segs[i]);
+    Free(o->segs);
+    Free(o->hdr);
+    Free(o);
+}
+
+// 참조 하나를 놓음. 마지막 참조였으면 해제함
+void large_put(large_obj *o)
+{
+    int last;
+
+    P(&large.mutex);
+    last = --o->refcnt == 0;
+    V(&large.mutex);
+    if (last)
+        large_free(o);
+}
+
+void large_hold(large_obj *o)
+{
+    P(&large.mutex);
+    o->refcnt++;
+    V(&large.mutex);
+}
+
+// 캐시에서 빼고 캐시의 참조를 놓음. 보내는 중인 독자가 있으면 마지막 독자가 해제함. large.mutex를 잡은 상태에서 호출함
+static void large_unlink(large_obj *o)
+{
+    large_obj **pp;
+
+    for (pp = &large.buckets[o->hash % LARGE_NBUCKETS]; *pp != o; pp = &(*pp)->next)
+        ;
+    *pp = o->next;
+    o->linked = 0;
+    large.nentries--;
+    large.used -= large_cost(o);
+    if (--o->refcnt == 0)
+        large_free(o);
+}
+
+// fetcher가 본문을 받기 전에 부름. 헤더를 복사해 두고, 참조 하나를 가진 채로 돌려줌
+large_obj *large_begin(char *uri, char *hdr, size_t hdrlen, size_t size, time_t expires)
+{
+    large_obj *o = Calloc(1, sizeof(large_obj));
+
+    strcpy(o->uri, uri);
+    o->hash = hash64(uri, strlen(uri));
+    o->hdr = Malloc(hdrlen);
+    memcpy(o->hdr, hdr, hdrlen);
+    o->hdrlen = hdrlen;
+    o->size = size;
+    o->expires = expires;
+    o->nsegs = (size + LARGE_SEGMENT_SIZE - 1) / LARGE_SEGMENT_SIZE;
+    o->segs = Calloc(o->nsegs, sizeof(char *));
+    o->refcnt = 1;
+    return o;
+}
+
+// 본문의 off 위치를 담을 세그먼트를 (없으면 할당해서) 돌려주고, 그 세그먼트에 남은 크기를 *room에 적음.
+// fetcher만 부르고, 다른 스레드는 fill이 알린 길이 안쪽의 세그먼트만 읽음
+static char *large_segment(large_obj *o, size_t off, size_t *room)
+{
+    int i = off / LARGE_SEGMENT_SIZE;
+
+    if (o->segs[i] == NULL)
+        o->segs[i] = Malloc(LARGE_SEGMENT_SIZE);
+    *room = LARGE_SEGMENT_SIZE - off % LARGE_SEGMENT_SIZE;
+    return o->segs[i] + off % LARGE_SEGMENT_SIZE;
+}
+
+// 본문을 다 받은 객체를 캐시에 넣음. 같은 uri의 이전 항목은 빼고, 예산이 찰 때까지 우선순위가 가장 낮은 항목을 차출함
+void large_store(large_obj *o)
+{
+    large_obj *p, *victim;
+    int i;
+
+    P(&large.mutex);
+    if (large_cost(o) > large.capacity)
+    {
+        large.rejected++;
+        V(&large.mutex);
+        return;
+    }
+    for (p = large.buckets[o->hash % LARGE_NBUCKETS]; p; p = p->next)
+        if (p->hash == o->hash && !strcmp(p->uri, o->uri))
+        {
+            large_unlink(p);
+            break;
+        }
+    // 항목 수는 예산 / MAX_OBJECT_SIZE 이하이므로 차출할 항목은 전체를 훑어 찾음
+    while (large.used + large_cost(o) > large.capacity)
+    {
+        victim = NULL;
+        for (i = 0; i < LARGE_NBUCKETS; i = i + 1)
+            for (p = large.buckets[i]; p; p = p->next)
+                if (victim == NULL || p->priority < victim->priority
+                        || (p->priority == victim->priority && p->atime < victim->atime))
+                    victim = p;
+        large.inflation = victim->priority;
+        large.evictions++;
+        large_unlink(victim);
+    }
+    large_touch(o);
+    o->linked = 1;
+    o->refcnt++;
+    o->next = large.buckets[o->hash % LARGE_NBUCKETS];
+    large.buckets[o->hash % LARGE_NBUCKETS] = o;
+    large.nentries++;
+    large.used += large_cost(o);
+    large.stored++;
+    V(&large.mutex);
+}
+
+// uri의 항목을 찾아 참조를 하나 잡고 돌려줌. 다 보낸 뒤 large_put을 불러야 함. 만료된 항목은 캐시에서 빼고 NULL을 리턴함
+large_obj *large_find(char *uri)
+{
+    uint64_t hash = hash64(uri, strlen(uri));
+    large_obj *o;
+
+    P(&large.mutex);
+    for (o = large.buckets[hash % LARGE_NBUCKETS]; o; o = o->next)
+        if (o->hash == hash && !strcmp(o->uri, uri))
+            break;
+    if (o && o->expires && o->expires <= time(NULL))
+    {
+        large_unlink(o);
+        large.expired++;
+        o = NULL;
+    }
+    if (o)
+    {
+        large_touch(o);
+        o->refcnt++;
+        large.hits++;
+    }
+    V(&large.mutex);
+    return o;
+}
+
+// 본문의 [off, off + len) 구간을 가리키는 iovec을 iov에 채우고 그 수를 리턴함
+static int large_iov(large_obj *o, size_t off, size_t len, struct iovec *iov)
+{
+    int n = 0;
+    size_t k;
+
+    while (len > 0)
+    {
+        k = LARGE_SEGMENT_SIZE - off % LARGE_SEGMENT_SIZE;
+        if (k > len)
+            k = len;
+        iov[n].iov_base = o->segs[off / LARGE_SEGMENT_SIZE] + off % LARGE_SEGMENT_SIZE;
+        iov[n].iov_len = k;
+        n++;
+        off += k;
+        len -= k;
+    }
+    return n;
+}
+
+// Range 헤더 값 spec("bytes=" 뒤)의 범위를 본문 길이 size에 맞춰 [*first, *last]로 풂.
+// 만족할 수 없는 범위면 0, 형식이 틀렸거나 범위가 여러 개면 -1을 리턴함 (이때는 Range를 무시하고 전체를 보냄)
+static int range_parse(char *spec, size_t size, size_t *first, size_t *last)
+{
+    unsigned long a, b;
+    char *end;
+
+    if (*spec == '-')
+    {
+        // 끝에서부터 b바이트
+        b = strtoul(spec + 1, &end, 10);
+        if (end == spec + 1)
+            return -1;
+        if (b == 0 || size == 0)
+            return 0;
+        *first = b >= size ? 0 : size - b;
+        *last = size - 1;
+    }
+    else
+    {
+        if (!isdigit((unsigned char)*spec))
+            return -1;
+        a = strtoul(spec, &end, 10);
+        if (*end++ != '-')
+            return -1;
+        b = size - 1;
+        if (isdigit((unsigned char)*end) && (b = strtoul(end, &end, 10)) < a)
+            return -1;
+        if (a >= size)
+            return 0;
+        *first = a;
+        *last = b >= size ? size - 1 : b;
+    }
+    return *end == '\r' || *end == '\0' ? 1 : -1;
+}
+
+// 캐시된 큰 객체를 보냄. range가 NULL이 아니면 그 구간만 206으로 보냄. keepalive에 따라 Connection 줄을 붙임
+static int large_send(int connfd, large_obj *o, char *range, int keepalive)
+{
+    struct iovec iov[LARGE_MAX_SEGS + 2];
+    size_t first = 0, last = o->size - 1, n;
+    char *hdr, *p, *eol, *end = o->hdr + o->hdrlen;
+    char *conn = keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    int rc, ok;
+
+    if (range == NULL || (rc = range_parse(range, o->size, &first, &last)) < 0)
+    {
+        iov[0].iov_base = o->hdr;
+        iov[0].iov_len = o->hdrlen;
+        iov[1].iov_base = keepalive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+        iov[1].iov_len = strlen(iov[1].iov_base);
+        return client_writev(connfd, iov, 2 + large_iov(o, 0, o->size, iov + 2));
+    }
+    P(&large.mutex);
+    large.range_hits++;
+    V(&large.mutex);
+    hdr = Malloc(o->hdrlen + MAXLINE);
+    if (rc == 0)
+    {
+        n = sprintf(hdr, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-length: 0\r\n%s\r\n", o->size, conn);
+        ok = client_write(connfd, hdr, n);
+        Free(hdr);
+        return ok;
+    }
+    // 저장된 헤더에서 상태줄과 Content-length만 바꿔 206 헤더를 만듦
+    n = sprintf(hdr, "HTTP/1.1 206 Partial Content\r\n");
+    for (p = memchr(o->hdr, '\n', o->hdrlen) + 1; p < end; p = eol)
+    {
+        eol = memchr(p, '\n', end - p);
+        eol = eol ? eol + 1 : end;
+        if (strncasecmp(p, "Content-length:", 15))
+        {
+            memcpy(hdr + n, p, eol - p);
+            n += eol - p;
+        }
+    }
+    n += sprintf(hdr + n, "Content-Range: bytes %zu-%zu/%zu\r\nContent-length: %zu\r\n%s\r\n",
+                 first, last, o->size, last - first + 1, conn);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = n;
+    ok = client_writev(connfd, iov, 1 + large_iov(o, first, last - first + 1, iov + 1));
+    Free(hdr);
+    return ok;
+}
+
+// SIGUSR1을 받으면 출력하는 큰 객체 캐시 통계
+void large_stats()
+{
+    P(&large.mutex);
+    printf("large cache: %d entries, %zu/%zu bytes, hits %lu (ranges %lu), stored %lu, evictions %lu, expired %lu, too large %lu\n",
+           large.nentries, large.used, large.capacity, large.hits, large.range_hits,
+           large.stored, large.evictions, large.expired, large.rejected);
+    V(&large.mutex);
+    fflush(stdout);
+}
+
+/*
+ * 디스크 캐시 (스레드 풀 모드, -d 옵션)
+ * 메모리 캐시에서 차출한 항목을 버리지 않고 디스크의 로그 파일 끝에 이어 써 두는 두 번째 계층.
+ * 파일은 DISK_CACHE_SIZE 크기의 원형 로그로, 끝에 닿으면 처음으로 돌아가 가장 오래된 레코드부터 덮어씀.
+ * 메모리에는 uri 해시 -> (레코드 위치, 길이)만 두고 uri와 응답은 파일에만 있음. 파일은 mmap해 두고 uri 비교,
+ * 히트한 응답 전송, 메모리 캐시로 올릴 때의 복사를 모두 매핑에서 바로 함.
+ * DISK_PROMOTE_HITS번 히트한 항목은 메모리 캐시로 다시 올리고 디스크 인덱스에서 뺌.
+ */
+#define DISK_PROMOTE_HITS 2
+#define DISK_NBUCKETS 4096
+#define DISK_MAGIC 0x50524f58 // "PROX"
+
+// 파일에 쓰는 레코드 머리. 바로 뒤에 uri(urilen 바이트, NUL 제외)와 응답이 이어짐
+typedef struct
+{
+    uint32_t magic;
+    uint32_t urilen;
+    uint64_t size;    // 응답 길이
+    uint64_t hash;
+} disk_rec;
+
+typedef struct disk_entry
+{
+    uint64_t hash;
+    size_t off;       // 레코드 위치
+    size_t len;       // 레코드 전체 길이 (8바이트 단위로 올림)
+    size_t size;      // 응답 길이
+    size_t hdrlen;    // 빈 줄 앞까지의 헤더 길이 (cache_block.hdrlen)
+    time_t expires;   // 메모리 캐시 항목의 만료 시각. 지나면 미스로 처리하고 뺌
+    uint32_t urilen;
+    int hits;
+    int refcnt;       // 보내거나 메모리 캐시로 올리는 중인 독자 수. 0이 아니면 레코드를 덮어쓰지 않음
+    struct disk_entry *hnext;       // 같은 버킷의 다음 항목
+    struct disk_entry *prev, *next; // 로그 순서 목록의 이웃 (앞쪽이 최근에 쓴 레코드)
+} disk_entry;
+
+typedef struct
+{
+    int fd;
+    char *map;                      // 파일 전체를 읽기 전용으로 매핑한 주소
+    size_t capacity;
+    size_t head;                    // 다음 레코드를 쓸 위치
+    disk_entry *buckets[DISK_NBUCKETS];
+    disk_entry *newest, *oldest;    // 로그 순서 목록. oldest부터 head 뒤쪽으로 파일 위치 순서와 같음
+    int nentries;
+    size_t live;                    // 인덱스에 있는 레코드 길이 합
+    sem_t mutex;                    // 인덱스, 목록, head, 통계 보호
+    unsigned long hits, promotions, demotions, overwritten, dropped, expired;
+} disk_cache;
+
+disk_cache disk;
+
+void disk_init(char *path, size_t capacity)
+{
+    memset(&disk, 0, sizeof(disk_cache));
+    disk.fd = Open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (ftruncate(disk.fd, capacity) < 0)
+        unix_error("ftruncate error");
+    disk.map = Mmap(NULL, capacity, PROT_READ, MAP_SHARED, disk.fd, 0);
+    disk.capacity = capacity;
+    Sem_init(&disk.mutex, 0, 1);
+}
+
+static char *disk_uri(disk_entry *e)
+{
+    return disk.map + e->off + sizeof(disk_rec);
+}
+
+// 인덱스와 로그 순서 목록에서 뺌. disk.mutex를 잡은 상태에서 호출하고, 독자가 없을 때만 부름
+static void disk_unlink(disk_entry *e)
+{
+    disk_entry **pp;
+
+    for (pp = &disk.buckets[e->hash % DISK_NBUCKETS]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        disk.newest = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        disk.oldest = e->prev;
+    disk.nentries--;
+    disk.live -= e->len;
+    Free(e);
+}
+
+static disk_entry *disk_lookup(char *uri, uint64_t hash)
+{
+    size_t urilen = strlen(uri);
+    disk_entry *e;
+
+    for (e = disk.buckets[hash % DISK_NBUCKETS]; e; e = e->hnext)
+        if (e->hash == hash && e->urilen == urilen && !memcmp(disk_uri(e), uri, urilen))
+            return e;
+    return NULL;
+}
+
+// 메모리 캐시에서 차출한 응답을 로그 끝에 씀. 이미 만료되었거나 덮어써야 할 오래된 레코드를 아직 보내는 독자가
+// 있으면 쓰지 않고 버림. 메모리 캐시가 잠금을 모두 놓은 뒤 slab_release에서 부름
+void disk_demote(char *uri, char *obj, size_t size, size_t hdrlen, time_t expires)
+{
+    uint64_t hash = hash64(uri, strlen(uri));
+    disk_rec rec;
+    disk_entry *e;
+    struct iovec iov[3];
+    size_t len = (sizeof(disk_rec) + strlen(uri) + size + 7) & ~(size_t)7;
+
+    rec.magic = DISK_MAGIC;
+    rec.urilen = strlen(uri);
+    rec.size = size;
+    rec.hash = hash;
+    P(&disk.mutex);
+    if (len > disk.capacity || (expires && expires <= time(NULL)))
+        goto drop;
+    if ((e = disk_lookup(uri, hash)) != NULL)
+    {
+        if (e->refcnt > 0)
+            goto drop;
+        disk_unlink(e);
+    }
+    // 끝에 자리가 없으면 처음으로 돌아감. 그 뒤에 남은 레코드가 가장 오래되었으므로 먼저 버림
+    if (disk.head + len > disk.capacity)
+    {
+        while ((e = disk.oldest) != NULL && e->off >= disk.head)
+        {
+            if (e->refcnt > 0)
+                goto drop;
+            disk_unlink(e);
+            disk.overwritten++;
+        }
+        disk.head = 0;
+    }
+    while ((e = disk.oldest) != NULL && e->off < disk.head + len && e->off + e->len > disk.head)
+    {
+        if (e->refcnt > 0)
+            goto drop;
+        disk_unlink(e);
+        disk.overwritten++;
+    }
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(disk_rec);
+    iov[1].iov_base = uri;
+    iov[1].iov_len = rec.urilen;
+    iov[2].iov_base = obj;
+    iov[2].iov_len = size;
+    if (pwritev(disk.fd, iov, 3, disk.head) != (ssize_t)(sizeof(disk_rec) + rec.urilen + size))
+        goto drop;
+
+    e = Calloc(1, sizeof(disk_entry));
+    e->hash = hash;
+    e->off = disk.head;
+    e->len = len;
+    e->size = size;
+    e->hdrlen = hdrlen;
+    e->expires = expires;
+    e->urilen = rec.urilen;
+    e->hnext = disk.buckets[hash % DISK_NBUCKETS];
+    disk.buckets[hash % DISK_NBUCKETS] = e;
+    e->next = disk.newest;
+    if (disk.newest)
+        disk.newest->prev = e;
+    else
+        disk.oldest = e;
+    disk.newest = e;
+    disk.nentries++;
+    disk.live += len;
+    disk.head += len;
+    disk.demotions++;
+    V(&disk.mutex);
+    return;
+
+drop:
+    disk.dropped++;
+    V(&disk.mutex);
+}
+
+// 디스크 캐시에 uri가 있으면 매핑에서 바로 보내고 1을 리턴함. *ok는 전송 성공 여부. keepalive에 따라 Connection 줄을 붙임.
+// DISK_PROMOTE_HITS번째 히트면 보낸 뒤 메모리 캐시에 다시 저장하고 디스크 인덱스에서 뺌. 만료된 레코드는 미스로 처리함
+int disk_serve(int connfd, char *uri, int keepalive, int *ok)
+{
+    uint64_t hash = hash64(uri, strlen(uri));
+    disk_entry *e;
+    char *obj;
+    int promote = 0;
+
+    if (disk.map == NULL)
+        return 0;
+    P(&disk.mutex);
+    if ((e = disk_lookup(uri, hash)) != NULL && e->expires && e->expires <= time(NULL))
+    {
+        // 보내는 중인 독자가 있으면 그 독자가 끝난 뒤 다음 조회에서 뺌
+        if (e->refcnt == 0)
+        {
+            disk_unlink(e);
+            disk.expired++;
+        }
+        e = NULL;
+    }
+    if (e != NULL)
+    {
+        e->refcnt++;
+        promote = ++e->hits >= DISK_PROMOTE_HITS;
+        disk.hits++;
+    }
+    V(&disk.mutex);
+    if (e == NULL)
+        return 0;
+
+    // sendfile은 페이지 캐시의 페이지를 소켓 버퍼에 걸어 두기만 하므로, 돌아온 뒤 레코드를 덮어쓰면 아직 전송되지 않은
+    // 바이트가 바뀜. write는 소켓 버퍼로 복사한 뒤 돌아오므로 독자가 끝나면 바로 덮어써도 됨
+    obj = disk.map + e->off + sizeof(disk_rec) + e->urilen;
+    *ok = send_stored(connfd, obj, e->size, e->hdrlen, keepalive);
+    // 메모리 캐시에 저장하다 다른 항목을 차출하면 disk_demote가 disk.mutex를 잡으므로 잠금 없이 복사함
+    if (promote)
+        cache_uri(&cache, uri, obj, e->size, e->expires);
+
+    P(&disk.mutex);
+    e->refcnt--;
+    if (promote && e->refcnt == 0)
+    {
+        disk_unlink(e);
+        disk.promotions++;
+    }
+    V(&disk.mutex);
+    return 1;
+}
+
+// SIGUSR1을 받으면 출력하는 디스크 캐시 통계
+void disk_stats()
+{
+    if (disk.map == NULL)
+        return;
+    P(&disk.mutex);
+    printf("disk cache: %d entries, %zu/%zu bytes live, hits %lu, promoted %lu, demoted %lu, overwritten %lu, dropped %lu, expired %lu\n",
+           disk.nentries, disk.live, disk.capacity, disk.hits, disk.promotions, disk.demotions,
+           disk.overwritten, disk.dropped, disk.expired);
+    V(&disk.mutex);
+    fflush(stdout);
+}
+
+/*
+ * 캐시 스냅샷 (스레드 풀 모드, -S 옵션)
+ * 재시작해도 빈 캐시로 시작하지 않도록, 메모리 캐시와 큰 객체 캐시의 항목을 uri, 헤더, 본문째 파일 하나에 적어 둠.
+ * SNAPSHOT_INTERVAL초마다, 그리고 SIGTERM/SIGINT로 종료할 때 백그라운드 스레드가 임시 파일에 쓴 뒤 rename으로 바꿔
+ * 끼우므로, 쓰다가 죽어도 이전 스냅샷은 온전히 남음. 시작할 때 파일을 mmap해 머리와 모든 레코드의 체크섬을 먼저
+ * 확인하고, 하나라도 틀리면 파일 전체를 무시함. 레코드는 오래 쓰이지 않은 항목부터 적어, 다시 넣었을 때 LRU
+ * 순서가 이어지게 함.
+ */
+#define SNAPSHOT_INTERVAL 60
+#define SNAP_MAGIC 0x50414e5358525850ULL // "PXRXSNAP"
+#define SNAP_VERSION 2
+#define SNAP_REC_MAGIC 0x43455253 // "SREC"
+#define SNAP_SMALL 0              // 메모리 캐시 항목. 본문 자리에 헤더를 포함한 응답 전체가 들어감
+#define SNAP_LARGE 1              // 큰 객체. 헤더와 본문을 따로 적음
+
+// 파일 머리. sum은 앞의 세 필드의 체크섬
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nrecs;
+    uint64_t created;
+    uint64_t sum;
+} snap_hdr;
+
+// 레코드 머리. 바로 뒤에 uri(NUL 제외), 헤더(hdrlen), 본문(size)이 이어짐
+typedef struct
+{
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t urilen;
+    uint32_t hdrlen;
+    uint64_t size;
+    int64_t expires;  // 항목의 만료 시각 (0이면 만료 없음)
+    uint64_t sum;     // expires에서 시작해 uri, 헤더, 본문을 더한 체크섬
+} snap_rec;
+
+// 스냅샷에 적을 메모리 캐시 항목과 그 항목이 마지막으로 쓰인 정도
+typedef struct
+{
+    cache_block *b;
+    unsigned long age;
+} snap_item;
+
+// 체크섬 sum에 buf를 더함. 본문은 세그먼트 경계에 맞춰 LARGE_SEGMENT_SIZE씩 나눠 더하므로,
+// 세그먼트로 나뉜 큰 객체를 쓸 때와 파일에서 이어진 본문을 읽을 때 값이 같음
+static uint64_t snap_sum(uint64_t sum, char *buf, size_t n)
+{
+    uint64_t v[2];
+    size_t k;
+
+    do
+    {
+        k = n < LARGE_SEGMENT_SIZE ? n : LARGE_SEGMENT_SIZE;
+        v[0] = sum;
+        v[1] = hash64(buf, k);
+        sum = hash64(v, sizeof(v));
+        buf += k;
+        n -= k;
+    } while (n > 0);
+    return sum;
+}
+
+static int snap_item_cmp(const void *a, const void *b)
+{
+    unsigned long x = ((snap_item *)a)->age, y = ((snap_item *)b)->age;
+
+    return x < y ? -1 : x > y;
+}
+
+static int snap_large_cmp(const void *a, const void *b)
+{
+    unsigned long x = (*(large_obj **)a)->atime, y = (*(large_obj **)b)->atime;
+
+    return x < y ? -1 : x > y;
+}
+
+// 레코드 하나를 씀. 본문은 iov의 조각들을 이어 붙인 것
+static int snap_write_rec(FILE *fp, int kind, char *uri, time_t expires, char *hdr, size_t hdrlen, struct iovec *iov, int iovcnt)
+{
+    snap_rec rec;
+    int i;
+
+    rec.magic = SNAP_REC_MAGIC;
+    rec.kind = kind;
+    rec.urilen = strlen(uri);
+    rec.hdrlen = hdrlen;
+    rec.size = 0;
+    rec.expires = expires;
+    rec.sum = snap_sum(rec.expires, uri, rec.urilen);
+    if (hdrlen > 0)
+        rec.sum = snap_sum(rec.sum, hdr, hdrlen);
+    for (i = 0; i < iovcnt; i = i + 1)
+    {
+        rec.sum = snap_sum(rec.sum, iov[i].iov_base, iov[i].iov_len);
+        rec.size += iov[i].iov_len;
+    }
+    if (fwrite(&rec, sizeof(snap_rec), 1, fp) != 1 || fwrite(uri, 1, rec.urilen, fp) != rec.urilen)
+        return -1;
+    if (hdrlen > 0 && fwrite(hdr, 1, hdrlen, fp) != hdrlen)
+        return -1;
+    for (i = 0; i < iovcnt; i = i + 1)
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, fp) != iov[i].iov_len)
+            return -1;
+    return 0;
+}
+
+// 두 캐시의 만료되지 않은 항목을 path에 씀. 항목 목록을 모으는 동안만 캐시 잠금을 잡고, 모은 항목은 refcnt로
+// 붙잡아 둔 채 잠금 없이 파일에 쓰므로 그 사이 요청 처리는 막히지 않음. 성공하면 0, 실패하면 -1을 리턴함
+int snapshot_write(char *path)
+{
+    snap_item *items;
+    large_obj **objs, *o;
+    cache_block *b;
+    cache_region *r;
+    snap_hdr hdr;
+    struct iovec iov[LARGE_MAX_SEGS];
+    char tmp[MAXLINE];
+    FILE *fp;
+    int i, j, n = 0, nobjs = 0, rc = -1, closed;
+    size_t bytes = 0;
+    time_t now = time(NULL);
+
+    // 히트해 referenced가 남은 항목은 아직 LRU 리스트 앞으로 옮겨지지 않았을 뿐 어느 항목보다 최근에 쓰인 것으로 봄
+    cache_lock_all(&cache);
+    for (i = 0; i < cache.nshards; i = i + 1)
+        n += cache.shards[i].nentries;
+    items = Malloc((n + 1) * sizeof(snap_item));
+    n = 0;
+    // 샤드마다 클래스별 영역의 두 리스트와 윈도를 돎
+    for (i = 0; i < 3 * cache.nshards; i = i + 1)
+        for (j = 0; j < cache.nclasses; j = j + 1)
+            for (r = &cache.shards[i / 3].region[j], b = (i % 3 < 2 ? r->list[i % 3] : r->window).head; b; b = b->next)
+            {
+                if (b->expires && b->expires <= now)
+                    continue;
+                __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+                items[n].b = b;
+                items[n].age = b->atime + (__atomic_load_n(&b->referenced, __ATOMIC_RELAXED) ? cache.clock : 0);
+                n++;
+            }
+    cache_unlock_all(&cache);
+    qsort(items, n, sizeof(snap_item), snap_item_cmp);
+
+    P(&large.mutex);
+    objs = Malloc((large.nentries + 1) * sizeof(large_obj *));
+    for (i = 0; i < LARGE_NBUCKETS; i = i + 1)
+        for (o = large.buckets[i]; o; o = o->next)
+            if (!o->expires || o->expires > now)
+            {
+                o->refcnt++;
+                objs[nobjs++] = o;
+            }
+    V(&large.mutex);
+    qsort(objs, nobjs, sizeof(large_obj *), snap_large_cmp);
+
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        fprintf(stderr, "snapshot: cannot create %s: %s\n", tmp, strerror(errno));
+        goto out;
+    }
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+    hdr.nrecs = n + nobjs;
+    hdr.created = now;
+    hdr.sum = hash64(&hdr, offsetof(snap_hdr, sum));
+    if (fwrite(&hdr, sizeof(snap_hdr), 1, fp) != 1)
+        goto fail;
+    for (i = 0; i < n; i = i + 1)
+    {
+        iov[0].iov_base = items[i].b->cache_obj;
+        iov[0].iov_len = items[i].b->size;
+        if (snap_write_rec(fp, SNAP_SMALL, items[i].b->cache_uri, items[i].b->expires, NULL, 0, iov, 1) < 0)
+            goto fail;
+        bytes += items[i].b->size;
+    }
+    for (i = 0; i < nobjs; i = i + 1)
+    {
+        if (snap_write_rec(fp, SNAP_LARGE, objs[i]->uri, objs[i]->expires, objs[i]->hdr, objs[i]->hdrlen,
+                           iov, large_iov(objs[i], 0, objs[i]->size, iov)) < 0)
+            goto fail;
+        bytes += objs[i]->hdrlen + objs[i]->size;
+    }
+    if (fflush(fp) == 0 && fsync(fileno(fp)) == 0)
+    {
+        // fclose는 실패해도 스트림을 닫으므로 결과와 상관없이 fp를 비움
+        closed = fclose(fp);
+        fp = NULL;
+        if (closed == 0 && rename(tmp, path) == 0)
+            rc = 0;
+    }
+
+fail:
+    if (fp)
+        fclose(fp);
+    if (rc < 0)
+    {
+        fprintf(stderr, "snapshot: writing %s failed: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    else
+        printf("snapshot: wrote %d objects, %d large objects, %zu bytes to %s\n", n, nobjs, bytes, path);
+out:
+    for (i = 0; i < n; i = i + 1)
+        readend(items[i].b);
+    for (i = 0; i < nobjs; i = i + 1)
+        large_put(objs[i]);
+    Free(items);
+    Free(objs);
+    fflush(stdout);
+    return rc;
+}
+
+// p의 레코드를 *rec에 읽고, 레코드가 end 안에 온전히 들어 있고 형식이 맞으면 uri의 위치를 돌려줌.
+// verify가 1이면 체크섬도 확인함. 틀리면 NULL
+static char *snap_next(char *p, char *end, snap_rec *rec, int verify)
+{
+    char *uri = p + sizeof(snap_rec);
+    uint64_t sum;
+
+    if ((size_t)(end - p) < sizeof(snap_rec))
+        return NULL;
+    memcpy(rec, p, sizeof(snap_rec));
+    if (rec->magic != SNAP_REC_MAGIC || rec->urilen == 0 || rec->urilen >= MAXLINE
+        || (size_t)(end - uri) < rec->urilen || (size_t)(end - uri) - rec->urilen < rec->hdrlen
+        || (size_t)(end - uri) - rec->urilen - rec->hdrlen < rec->size)
+        return NULL;
+    if (rec->kind == SNAP_SMALL ? rec->hdrlen != 0 || rec->size == 0 || rec->size > MAX_OBJECT_SIZE
+                                : rec->kind != SNAP_LARGE || rec->hdrlen == 0 || rec->size == 0 || rec->size > LARGE_OBJECT_MAX)
+        return NULL;
+    if (verify)
+    {
+        sum = snap_sum(rec->expires, uri, rec->urilen);
+        if (rec->hdrlen > 0)
+            sum = snap_sum(sum, uri + rec->urilen, rec->hdrlen);
+        if (snap_sum(sum, uri + rec->urilen + rec->hdrlen, rec->size) != rec->sum)
+            return NULL;
+    }
+    return uri;
+}
+
+// 시작할 때 path의 스냅샷을 캐시에 채움. 파일이 없으면 빈 캐시로 시작하고, 버전이 다르거나 체크섬이 하나라도
+// 틀리면 아무것도 넣지 않음. 꺼져 있던 사이 만료된 항목은 넣지 않음
+void snapshot_load(char *path)
+{
+    struct stat st;
+    snap_hdr hdr;
+    snap_rec rec;
+    large_obj *o;
+    char *map, *end, *p, *src, *dst, uri[MAXLINE];
+    size_t off, room;
+    int fd, pass;
+    uint32_t i, nexpired = 0;
+    time_t now = time(NULL);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_hdr))
+    {
+        fprintf(stderr, "snapshot: %s is too short, ignored\n", path);
+        Close(fd);
+        return;
+    }
+    map = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Close(fd);
+    end = map + st.st_size;
+    memcpy(&hdr, map, sizeof(snap_hdr));
+    if (hdr.magic != SNAP_MAGIC || hdr.version != SNAP_VERSION || hdr.sum != hash64(&hdr, offsetof(snap_hdr, sum)))
+    {
+        fprintf(stderr, "snapshot: %s has a bad header, ignored\n", path);
+        Munmap(map, st.st_size);
+        return;
+    }
+
+    // 첫 번째 바퀴에서 모든 레코드를 확인하고, 두 번째 바퀴에서 캐시에 넣음
+    for (pass = 0; pass < 2; pass = pass + 1)
+    {
+        p = map + sizeof(snap_hdr);
+        for (i = 0; i < hdr.nrecs; i = i + 1)
+        {
+            if ((src = snap_next(p, end, &rec, pass == 0)) == NULL)
+                break;
+            p = src + rec.urilen + rec.hdrlen + rec.size;
+            if (pass == 0)
+                continue;
+            if (rec.expires && rec.expires <= now)
+            {
+                nexpired++;
+                continue;
+            }
+            memcpy(uri, src, rec.urilen);
+            uri[rec.urilen] = '\0';
+            src += rec.urilen;
+            if (rec.kind == SNAP_SMALL)
+            {
+                cache_uri(&cache, uri, src, rec.size, rec.expires);
+                continue;
+            }
+            o = large_begin(uri, src, rec.hdrlen, rec.size, rec.expires);
+            src += rec.hdrlen;
+            for (off = 0; off < rec.size; off += room)
+            {
+                dst = large_segment(o, off, &room);
+                if (room > rec.size - off)
+                    room = rec.size - off;
+                memcpy(dst, src + off, room);
+            }
+            large_store(o);
+            large_put(o);
+        }
+        if (pass == 0 && (i < hdr.nrecs || p != end))
+        {
+            fprintf(stderr, "snapshot: %s is corrupt at record %u, ignored\n", path, i);
+            Munmap(map, st.st_size);
+            return;
+        }
+    }
+    Munmap(map, st.st_size);
+    printf("snapshot: loaded %u objects from %s (saved %lds ago, %u expired since)\n", hdr.nrecs - nexpired, path,
+           (long)(now - hdr.created), nexpired);
+    fflush(stdout);
+}
+
+// SNAPSHOT_INTERVAL초마다 스냅샷을 쓰고, SIGTERM/SIGINT를 받으면 마지막으로 한 번 더 쓴 뒤 종료함
+void *snapshot_routine(void *vargp)
+{
+    char *path = vargp;
+    struct timespec interval = {SNAPSHOT_INTERVAL, 0};
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    while (1)
+    {
+        if ((sig = sigtimedwait(&mask, NULL, &interval)) < 0 && errno != EAGAIN)
+            continue;
+        snapshot_write(path);
+        if (sig > 0)
+            exit(0);
+    }
+    return NULL;
+}
+
+// 캐시 미스를 하나의 서버 요청으로 모으기 위한 fill의 결과
+typedef enum
+{
+    FILL_PENDING,     // fetcher가 아직 서버에서 가져오는 중
+    FILL_CACHED,      // 응답을 캐시에 저장함
+    FILL_UNCACHEABLE, // 응답은 받았지만 캐시할 수 없음 (너무 크거나 상태 코드, Cache-Control 등이 저장을 막음)
+    FILL_FAILED,      // 서버 연결이나 응답이 중간에 실패함
+    FILL_STREAMED     // 기다리던 스레드가 받는 중인 응답을 fill 버퍼에서 따라가며 보냄 (fill_wait의 리턴값으로만 쓰임)
+} fill_state;
+
+// 같은 uri에 대해 진행 중인 서버 요청 하나. 처음 미스한 스레드(fetcher)가 만들고, 나중에 미스한 스레드들은 결과를 기다림.
+// fetcher는 캐시에 저장할 형태(hop-by-hop 헤더를 뺀 헤더, 빈 줄, 본문)의 응답을 buf에 모으고, 받은 만큼 len을 늘려 알림.
+// 본문 길이를 미리 알 수 있으면 기다리던 스레드는 끝날 때까지 기다리지 않고 buf에 들어온 만큼씩 바로 보냄.
+// 큰 객체는 헤더와 빈 줄만 buf에 두고 본문은 lo의 세그먼트에 모으며, len은 그 본문까지 이어 센 길이임
+typedef struct fill
+{
+    char uri[MAXLINE];
+    fill_state state;
+    int refcnt;        // fetcher와 기다리는 스레드 중 아직 fill을 쓰고 있는 수. 0이 되면 해제함. fill_mutex로 보호
+    char *buf;         // MAX_OBJECT_SIZE 크기
+    int headers;       // 헤더를 buf에 다 받았으면 1
+    size_t hdrlen;     // buf에서 헤더의 길이. 그 뒤에 빈 줄과 본문이 이어짐
+    size_t len;        // buf에 받은 바이트 수
+    size_t total;      // 다 받았을 때의 len. 본문 길이를 모르거나 캐시할 수 없으면 0이고, 이때는 따라가며 보낼 수 없음
+    large_obj *lo;     // 큰 객체를 받는 중이면 그 객체. fill이 참조 하나를 가짐
+    pthread_mutex_t lock; // state, headers, hdrlen, len, total 보호
+    pthread_cond_t cond;  // 위 값이 바뀔 때마다 broadcast
+    struct fill *next;
+} fill_t;
+
+static fill_t *fills;  // 진행 중인 fill 목록. 동시에 진행되는 fill은 워커 수를 넘지 않으므로 리스트로 충분함
+static sem_t fill_mutex;
+
+void fill_init()
+{
+    fills = NULL;
+    Sem_init(&fill_mutex, 0, 1);
+}
+
+// uri에 대해 진행 중인 fill에 합류함. 없으면 새로 만들고 *fetcher를 1로 둠
+fill_t *fill_join(char *uri, int *fetcher)
+{
+    fill_t *f;
+
+    P(&fill_mutex);
+    for (f = fills; f; f = f->next)
+        if (!strcmp(f->uri, uri))
+            break;
+    if (f)
+    {
+        f->refcnt++;
+        *fetcher = 0;
+    }
+    else
+    {
+        f = Calloc(1, sizeof(fill_t));
+        strcpy(f->uri, uri);
+        f->state = FILL_PENDING;
+        f->refcnt = 1;
+        f->buf = Malloc(MAX_OBJECT_SIZE);
+        pthread_mutex_init(&f->lock, NULL);
+        pthread_cond_init(&f->cond, NULL);
+        f->next = fills;
+        fills = f;
+        *fetcher = 1;
+    }
+    V(&fill_mutex);
+    return f;
+}
+
+static void fill_put(fill_t *f)
+{
+    int last;
+
+    P(&fill_mutex);
+    last = --f->refcnt == 0;
+    V(&fill_mutex);
+    if (last)
+    {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        if (f->lo)
+            large_put(f->lo);
+        Free(f->buf);
+        Free(f);
+    }
+}
+
+// 캐시하지 않을 응답임을 안 fetcher가 부름. 본문을 다 받을 때까지 기다리게 하지 않고 기다리던 스레드를 깨워
+// 각자 서버에 요청하게 함. fill은 fill_finish까지 목록에 남으므로 그 사이 미스한 스레드도 합류하자마자 서버로 감
+static void fill_uncacheable(fill_t *f)
+{
+    pthread_mutex_lock(&f->lock);
+    f->state = FILL_UNCACHEABLE;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// fetcher가 응답 헤더와 빈 줄을 buf에 모은 뒤 부름. total은 응답을 다 받았을 때의 길이이고, 모르면 0.
+// 본문을 큰 객체 lo에 받으면 lo도 넘김. cacheable이 0이면 어느 캐시에도 저장하지 않을 응답이므로 fill_uncacheable과 같이 알림
+static void fill_headers(fill_t *f, size_t hdrlen, size_t total, large_obj *lo, int cacheable)
+{
+    if (lo)
+        large_hold(lo);
+    pthread_mutex_lock(&f->lock);
+    f->lo = lo;
+    f->headers = 1;
+    f->hdrlen = hdrlen;
+    f->len = hdrlen + 2;
+    f->total = total;
+    if (!cacheable)
+        f->state = FILL_UNCACHEABLE;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// fetcher가 본문을 buf의 len 위치 뒤에 이어 붙인 뒤 새 길이를 알림
+static void fill_progress(fill_t *f, size_t len)
+{
+    pthread_mutex_lock(&f->lock);
+    f->len = len;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+// fetcher를 기다림. 본문 길이를 아는 응답이면 헤더가 들어오는 대로 connfd에 보내기 시작하고, 이후 buf에 들어오는
+// 만큼씩 따라가며 보낸 뒤 FILL_STREAMED를 리턴함. 중간에 서버나 클라이언트 연결이 끊기면 *keepalive를 0으로 둠.
+// 따라갈 수 없는 응답이면 fetcher가 끝날 때까지 기다렸다가 그 결과를 리턴하고, 캐시하지 않을 응답이면 그렇다고 알게 되는
+// 대로 FILL_UNCACHEABLE을 리턴함
+fill_state fill_wait(fill_t *f, int connfd, int *keepalive)
+{
+    fill_state st;
+    size_t pos, end;
+    char extra[64];
+    struct iovec iov[LARGE_MAX_SEGS + 1];
+    int ok;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->state == FILL_PENDING && !(f->headers && f->total))
+        pthread_cond_wait(&f->cond, &f->lock);
+    st = f->state;
+    pthread_mutex_unlock(&f->lock);
+    if (st == FILL_FAILED || !(f->headers && f->total))
+    {
+        fill_put(f);
+        return st;
+    }
+
+    // 캐시에 저장할 형태의 헤더에는 Content-length가 있으므로 연결 헤더만 붙여 보냄
+    sprintf(extra, "%s\r\n", *keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    iov[0].iov_base = f->buf;
+    iov[0].iov_len = f->hdrlen;
+    iov[1].iov_base = extra;
+    iov[1].iov_len = strlen(extra);
+    ok = client_writev(connfd, iov, 2);
+    pos = f->hdrlen + 2;
+    while (ok)
+    {
+        pthread_mutex_lock(&f->lock);
+        while (f->len == pos && f->state == FILL_PENDING)
+            pthread_cond_wait(&f->cond, &f->lock);
+        end = f->len;
+        pthread_mutex_unlock(&f->lock);
+        if (end == pos)
+            break;
+        if (f->lo)
+            ok = client_writev(connfd, iov, large_iov(f->lo, pos - f->hdrlen - 2, end - pos, iov));
+        else
+            ok = client_write(connfd, f->buf + pos, end - pos);
+        pos = end;
+    }
+    // 서버가 본문을 다 보내기 전에 끊었으면 클라이언트도 응답의 끝을 알 수 없으므로 연결을 닫음
+    if (!ok || pos < f->total)
+        *keepalive = 0;
+    fill_put(f);
+    return FILL_STREAMED;
+}
+
+// fetcher가 결과를 기록하고 기다리는 스레드를 모두 깨움. 목록에서 먼저 빼므로 이후의 미스는 새 fill을 만듦
+void fill_finish(fill_t *f, fill_state st)
+{
+    fill_t **pp;
+
+    P(&fill_mutex);
+    for (pp = &fills; *pp != f; pp = &(*pp)->next)
+        ;
+    *pp = f->next;
+    V(&fill_mutex);
+    pthread_mutex_lock(&f->lock);
+    f->state = st;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    fill_put(f);
+}
+
+
+// 클라이언트 연결 하나에서 요청을 반복해서 처리함 (HTTP keep-alive).
+// 요청마다(첫 요청 포함) 첫 바이트는 KEEPALIVE_TIMEOUT초까지만 기다리고, 요청 헤더 전체는 HEADER_TIMEOUT초 안에
+// 받아야 함. 어느 쪽이든 시간이 지나면 연결을 닫아, 아무것도 보내지 않거나 헤더를 조금씩 보내는 클라이언트가
+// 워커를 붙잡지 못하게 함. 한 연결에서 최대 KEEPALIVE_MAX개의 요청을 처리함
+void serve_client(int connfd)
+{
+    rio_t rio;
+    struct pollfd pfd;
+    int nreq;
+
+    Rio_readinitb(&rio, connfd);
+    for (nreq = 1; nreq <= KEEPALIVE_MAX; nreq = nreq + 1)
+    {
+        // rio 버퍼에 이미 다음 요청이 들어와 있으면 기다리지 않음
+        if (rio.rio_cnt <= 0)
+        {
+            pfd.fd = connfd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000) <= 0)
+                break;
+        }
+        // 헤더를 읽는 rio_readlineb는 마감이 지나면 ETIMEDOUT으로 실패하고 doit은 0을 리턴함.
+        // 헤더를 다 읽은 뒤로는 클라이언트에게서 읽지 않으므로 마감은 다음 요청 전에만 새로 걺
+        rio_setdeadline(&rio, HEADER_TIMEOUT * 1000);
+        if (!doit(connfd, &rio, nreq == KEEPALIVE_MAX))
+            break;
+    }
+}
+
+// 클라이언트와의 연결마다 다시 붙이는 hop-by-hop 헤더인지 확인함
+static int is_hop_header(char *line)
+{
+    return !strncasecmp(line, "Connection:", 11) || !strncasecmp(line, "Proxy-Connection:", 17)
+        || !strncasecmp(line, "Keep-Alive:", 11);
+}
+
+/*
+ * 응답의 캐시 가능 여부와 신선도 (RFC 9111)
+ * 서버 응답의 상태 코드와 Cache-Control, Expires, Date, Age 헤더로 캐시에 저장해도 되는지와 만료 시각을 정함.
+ * 프록시는 조건부 요청으로 재검증하지 않으므로 no-cache도 no-store처럼 저장하지 않고, 공유 캐시이므로 private도
+ * 저장하지 않음. 신선도는 s-maxage, max-age, Expires - Date 순으로 정하고, 아무것도 없으면 기본적으로 캐시할 수 있는
+ * 상태 코드에 한해 HTTP_DEFAULT_TTL초를 줌. 만료된 항목은 미스로 처리해 서버에서 다시 가져옴.
+ */
+#define HTTP_DEFAULT_TTL 300 // 신선도 정보가 없는 응답을 캐시에 두는 시간(초)
+
+typedef struct
+{
+    int status;
+    int nostore;     // no-store, no-cache 또는 private
+    long maxage;     // s-maxage가 있으면 그 값, 없으면 max-age. 둘 다 없으면 -1
+    int smaxage;     // maxage가 s-maxage에서 왔으면 1
+    long age;        // Age 헤더. 다른 캐시에 머문 시간
+    int has_expires;
+    time_t expires;  // Expires. 형식이 틀리면 0 (이미 만료된 것으로 봄)
+    time_t date;     // Date. 없으면 0
+} http_fresh;
+
+static void fresh_init(http_fresh *h)
+{
+    memset(h, 0, sizeof(http_fresh));
+    h->maxage = -1;
+}
+
+// HTTP-date("Sun, 06 Nov 1994 08:49:37 GMT")를 읽음. 형식이 틀리면 0
+static time_t http_date(char *s)
+{
+    struct tm tm;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    memset(&tm, 0, sizeof(struct tm));
+    if (strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+        return 0;
+    return timegm(&tm);
+}
+
+// delta-seconds 값을 읽음. 숫자가 아니거나 음수면 0 (이미 만료된 것으로 봄)
+static long http_seconds(char *s)
+{
+    long v;
+
+    if (*s == '"')
+        s++;
+    if (!isdigit((unsigned char)*s))
+        return 0;
+    v = strtol(s, NULL, 10);
+    return v > 0 ? v : 0;
+}
+
+// Cache-Control 값의 지시어들을 읽음. 같은 헤더가 여러 줄이면 줄마다 부름
+static void fresh_cache_control(http_fresh *h, char *p)
+{
+    size_t n;
+
+    while (1)
+    {
+        p += strspn(p, " \t,");
+        if (*p == '\0' || *p == '\r' || *p == '\n')
+            return;
+        n = strcspn(p, " \t,=\r\n");
+        if ((n == 8 && !strncasecmp(p, "no-store", 8)) || (n == 8 && !strncasecmp(p, "no-cache", 8))
+                || (n == 7 && !strncasecmp(p, "private", 7)))
+            h->nostore = 1;
+        else if (n == 8 && !strncasecmp(p, "s-maxage", 8) && p[8] == '=')
+        {
+            h->maxage = http_seconds(p + 9);
+            h->smaxage = 1;
+        }
+        else if (n == 7 && !strncasecmp(p, "max-age", 7) && p[7] == '=' && !h->smaxage)
+            h->maxage = http_seconds(p + 8);
+        p += n;
+        // 값은 따옴표로 감쌌을 수 있음
+        if (*p == '=')
+        {
+            p++;
+            if (*p == '"' && (p = strchr(p + 1, '"')) == NULL)
+                return;
+            p += strcspn(p, ",\r\n");
+        }
+    }
+}
+
+// 응답 헤더 한 줄(상태줄 제외)을 봄
+static void fresh_header(http_fresh *h, char *line)
+{
+    if (!strncasecmp(line, "Cache-Control:", 14))
+        fresh_cache_control(h, line + 14);
+    else if (!strncasecmp(line, "Expires:", 8))
+    {
+        h->has_expires = 1;
+        h->expires = http_date(line + 8);
+    }
+    else if (!strncasecmp(line, "Date:", 5))
+        h->date = http_date(line + 5);
+    else if (!strncasecmp(line, "Age:", 4))
+        h->age = http_seconds(line + 4 + strspn(line + 4, " \t"));
+}
+
+// 신선도 정보 없이도 캐시할 수 있는 상태 코드인지 확인함 (RFC 9110 15.1에서 본문을 저장할 수 있는 것만)
+static int http_heuristic_status(int status)
+{
+    return status == 200 || status == 203 || status == 300 || status == 301 || status == 308
+        || status == 404 || status == 410;
+}
+
+// 받은 시각 now를 기준으로 응답의 만료 시각을 정함. 캐시에 저장하면 안 되거나 이미 만료된 응답이면 0.
+// 206은 일부만 담고 있고 304와 1xx는 저장할 본문이 없으므로 저장하지 않음
+static time_t fresh_expiry(http_fresh *h, time_t now)
+{
+    long lifetime;
+
+    if (h->nostore || h->status < 200 || h->status == 206 || h->status == 304)
+        return 0;
+    if (h->maxage >= 0)
+        lifetime = h->maxage;
+    else if (h->has_expires)
+        lifetime = h->expires ? (long)(h->expires - (h->date ? h->date : now)) : 0;
+    else if (http_heuristic_status(h->status))
+        lifetime = HTTP_DEFAULT_TTL;
+    else
+        return 0;
+    lifetime -= h->age;
+    return lifetime > 0 ? now + lifetime : 0;
+}
+
+/*
+ * 서버 연결 풀 (스레드 풀 모드)
+ * 응답을 끝까지 읽은 서버 연결을 닫지 않고 host:port별로 보관했다가, 같은 서버로 가는 다음 요청에서 다시 씀.
+ * 서버에는 HTTP/1.1 keep-alive로 요청하고, 응답 본문의 끝은 Content-length나 chunked 인코딩으로 판단함.
+ * 보관한 지 POOL_IDLE_TIMEOUT초가 지난 연결은 닫고, 꺼낼 때는 서버가 그 사이에 연결을 끊지 않았는지 확인함.
+ */
+#define POOL_MAX_IDLE 64     // 풀 전체에 보관하는 유휴 연결 수 상한
+#define POOL_MAX_PER_HOST 8  // host:port 하나당 보관하는 유휴 연결 수 상한
+#define POOL_IDLE_TIMEOUT 30 // 유휴 연결을 보관하는 최대 시간(초)
+#define POOL_NBUCKETS 256
+
+typedef struct pool_conn
+{
+    int fd;
+    time_t idle_since; // 풀에 돌려받은 시각
+    struct pool_conn *next;
+} pool_conn;
+
+typedef struct pool_host
+{
+    char key[MAXLINE];      // "host:port"
+    pool_conn *idle;        // 유휴 연결 목록. 가장 최근에 돌려받은 연결이 맨 앞에 있음
+    int nidle;
+    struct pool_host *next; // 같은 버킷의 다음 host
+} pool_host;
+
+typedef struct
+{
+    pool_host *buckets[POOL_NBUCKETS];
+    int nidle;         // 풀 전체의 유휴 연결 수
+    time_t last_sweep; // 마지막으로 만료된 연결을 정리한 시각
+    sem_t mutex;
+    unsigned long opened;   // 새로 연결한 횟수
+    unsigned long reused;   // 풀에서 꺼내 다시 쓴 횟수
+    unsigned long returned; // 풀에 돌려받은 횟수
+    unsigned long stale;    // 꺼낼 때 서버가 이미 끊은 것으로 확인되어 버린 횟수
+    unsigned long expired;  // 유휴 시간이 지나 닫은 횟수
+    unsigned long dropped;  // 상한에 걸려 돌려받지 못하고 닫은 횟수
+} conn_pool;
+
+conn_pool pool;
+
+void pool_init()
+{
+    memset(&pool, 0, sizeof(conn_pool));
+    pool.last_sweep = time(NULL);
+    Sem_init(&pool.mutex, 0, 1);
+}
+
+// key에 해당하는 host를 찾음. create가 1이면 없을 때 새로 만듦. pool.mutex를 잡은 상태에서 호출함
+static pool_host *pool_lookup(char *key, int create)
+{
+    unsigned int h = 5381;
+    char *p;
+    pool_host *ph;
+
+    for (p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    h = h % POOL_NBUCKETS;
+    for (ph = pool.buckets[h]; ph; ph = ph->next)
+        if (!strcmp(ph->key, key))
+            return ph;
+    if (!create)
+        return NULL;
+    ph = Calloc(1, sizeof(pool_host));
+    strcpy(ph->key, key);
+    ph->next = pool.buckets[h];
+    pool.buckets[h] = ph;
+    return ph;
+}
+
+// 유휴 시간이 지난 연결을 모두 닫고, 유휴 연결이 없는 host는 지움. pool.mutex를 잡은 상태에서 호출함
+static void pool_sweep(time_t now)
+{
+    pool_host **hp, *ph;
+    pool_conn **cp, *pc;
+    int i;
+
+    for (i = 0; i < POOL_NBUCKETS; i = i + 1)
+    {
+        hp = &pool.buckets[i];
+        while ((ph = *hp) != NULL)
+        {
+            cp = &ph->idle;
+            while ((pc = *cp) != NULL)
+            {
+                if (now - pc->idle_since < POOL_IDLE_TIMEOUT)
+                {
+                    cp = &pc->next;
+                    continue;
+                }
+                *cp = pc->next;
+                Close(pc->fd);
+                Free(pc);
+                ph->nidle--;
+                pool.nidle--;
+                pool.expired++;
+            }
+            if (ph->nidle == 0)
+            {
+                *hp = ph->next;
+                Free(ph);
+            }
+            else
+                hp = &ph->next;
+        }
+    }
+    pool.last_sweep = now;
+}
+
+// host:port로 가는 연결을 얻음. 풀에 쓸 수 있는 유휴 연결이 있으면 *reused를 1로, 없어서 새로 연결했으면 0으로 둠.
+// 연결에 실패하면 -1을 리턴함
+int pool_checkout(char *hostname, char *port, int *reused)
+{
+    char key[MAXLINE], c;
+    pool_host *ph;
+    pool_conn *pc;
+    time_t now = time(NULL);
+    int fd;
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    while (1)
+    {
+        P(&pool.mutex);
+        if ((ph = pool_lookup(key, 0)) == NULL || (pc = ph->idle) == NULL)
+        {
+            V(&pool.mutex);
+            break;
+        }
+        ph->idle = pc->next;
+        ph->nidle--;
+        pool.nidle--;
+        // 유휴 연결은 최근 것부터 꺼내므로 유휴 시간이 지난 연결이 나오면 나머지도 모두 지난 것임
+        if (now - pc->idle_since >= POOL_IDLE_TIMEOUT)
+        {
+            pool_sweep(now);
+            V(&pool.mutex);
+            Close(pc->fd);
+            Free(pc);
+            continue;
+        }
+        V(&pool.mutex);
+        fd = pc->fd;
+        Free(pc);
+        // 서버가 유휴 연결을 닫았으면 EOF가, 요청하지 않은 데이터가 와 있으면 그 데이터가 보이므로 둘 다 버림.
+        // 읽을 것이 없어 EAGAIN이 나와야 살아 있는 연결임
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            P(&pool.mutex);
+            pool.reused++;
+            V(&pool.mutex);
+            *reused = 1;
+            return fd;
+        }
+        Close(fd);
+        P(&pool.mutex);
+        pool.stale++;
+        V(&pool.mutex);
+    }
+    *reused = 0;
+    if ((fd = open_clientfd(hostname, port)) < 0)
+        return -1;
+    P(&pool.mutex);
+    pool.opened++;
+    V(&pool.mutex);
+    return fd;
+}
+
+// 응답을 끝까지 읽은 연결을 풀에 돌려줌. host별 또는 전체 상한을 넘으면 연결을 닫음
+void pool_checkin(char *hostname, char *port, int fd)
+{
+    char key[MAXLINE];
+    pool_host *ph;
+    pool_conn *pc;
+    time_t now = time(NULL);
+
+    snprintf(key, MAXLINE, "%s:%s", hostname, port);
+    P(&pool.mutex);
+    if (now - pool.last_sweep >= POOL_IDLE_TIMEOUT)
+        pool_sweep(now);
+    ph = pool_lookup(key, 1);
+    if (ph->nidle >= POOL_MAX_PER_HOST || pool.nidle >= POOL_MAX_IDLE)
+    {
+        pool.dropped++;
+        V(&pool.mutex);
+        Close(fd);
+        return;
+    }
+    pc = Malloc(sizeof(pool_conn));
+    pc->fd = fd;
+    pc->idle_since = now;
+    pc->next = ph->idle;
+    ph->idle = pc;
+    ph->nidle++;
+    pool.nidle++;
+    pool.returned++;
+    V(&pool.mutex);
+}
+
+// SIGUSR1을 받으면 출력하는 연결 풀 통계. 재사용률은 서버 연결이 필요했던 요청 중 풀에서 꺼내 쓴 비율
+void pool_stats()
+{
+    unsigned long total;
+
+    P(&pool.mutex);
+    total = pool.opened + pool.reused;
+    printf("upstream pool: opened %lu, reused %lu (%.1f%%), returned %lu, stale %lu, expired %lu, dropped %lu, idle %d\n",
+           pool.opened, pool.reused, total ? 100.0 * pool.reused / total : 0.0,
+           pool.returned, pool.stale, pool.expired, pool.dropped, pool.nidle);
+    V(&pool.mutex);
+    fflush(stdout);
+}
+
+// 서버 응답 본문을 읽는 상태. 본문의 끝은 Content-length, chunked 인코딩, 또는 EOF로 정해짐
+typedef struct
+{
+    long remaining;  // Content-length 방식에서 남은 바이트. -1이면 EOF가 본문의 끝
+    int chunked;     // 서버가 chunked 인코딩으로 보내면 1
+    long chunk_left; // 현재 청크에서 남은 바이트
+    int done;        // 본문을 끝까지 읽었으면 1
+} body_t;
+
+// 본문을 도착한 만큼 최대 n바이트 읽어 usrbuf에 채움. chunked 본문은 청크 헤더와 트레일러를 벗겨낸 데이터만 돌려줌.
+// 읽은 바이트 수를 리턴하고, 본문이 끝났으면 0, 본문이 끝나기 전에 연결이 끊기거나 형식이 틀렸으면 -1을 리턴함
+static ssize_t body_read(body_t *b, rio_t *rp, char *usrbuf, size_t n)
+{
+    char line[MAXLINE];
+    ssize_t rc;
+
+    if (b->done)
+        return 0;
+    if (b->chunked)
+    {
+        if (b->chunk_left == 0)
+        {
+            // 청크 크기 줄 (확장은 무시). 크기가 0이면 트레일러를 빈 줄까지 버리고 본문이 끝남
+            if (rio_readlineb(rp, line, MAXLINE) <= 0 || !isxdigit((unsigned char)line[0]))
+                return -1;
+            if ((b->chunk_left = strtol(line, NULL, 16)) <= 0)
+            {
+                do
+                {
+                    if (rio_readlineb(rp, line, MAXLINE) <= 0)
+                        return -1;
+                } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+                b->done = 1;
+                return 0;
+            }
+        }
+        if ((long)n > b->chunk_left)
+            n = b->chunk_left;
+        if ((rc = rio_readsomeb(rp, usrbuf, n)) <= 0)
+            return -1;
+        // 청크 데이터 뒤의 CRLF
+        if ((b->chunk_left -= rc) == 0 && rio_readlineb(rp, line, MAXLINE) <= 0)
+            return -1;
+        return rc;
+    }
+    if (b->remaining > 0 && (long)n > b->remaining)
+        n = b->remaining;
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0)
+        return -1;
+    if (rc == 0)
+    {
+        if (b->remaining > 0)
+            return -1;
+        b->done = 1;
+        return 0;
+    }
+    if (b->remaining > 0 && (b->remaining -= rc) == 0)
+        b->done = 1;
+    return rc;
+}
+
+// 캐시에 uri가 있으면 클라이언트에게 보내고 1을 리턴함. *ok는 전송 성공 여부.
+// range는 요청의 Range 값으로, 큰 객체 캐시에서 찾은 경우에만 씀. keepalive는 응답에 붙일 Connection 줄을 정함.
+// count는 cache_find에 넘김. 같은 요청으로 다시 확인할 때는 0을 넘겨 히트와 미스를 한 번만 셈
+static int serve_cached(int connfd, char *uri, char *range, int keepalive, int count, int *ok)
+{
+    cache_block *b;
+    large_obj *o;
+
+    if ((b = cache_find(&cache, uri, count)) != NULL)
+    {
+        // 캐시 객체는 Content-length가 붙은 응답으로 저장되어 있으므로 Connection 줄만 끼워 writev 한 번으로 보냄
+        *ok = send_stored(connfd, b->cache_obj, b->size, b->hdrlen, keepalive);
+        readend(b);
+        return 1;
+    }
+    if ((o = large_find(uri)) != NULL)
+    {
+        *ok = large_send(connfd, o, range, keepalive);
+        large_put(o);
+        return 1;
+    }
+    return disk_serve(connfd, uri, keepalive, ok);
+}
+
+// 요청 헤더에서 바이트 범위 하나를 요청하는 Range 값("bytes=" 뒤)을 찾음. If-Range가 붙은 요청은 전체를 보내도록 NULL을 리턴함
+static char *request_range(char *HTTPheader)
+{
+    char *p;
+
+    if ((p = strcasestr(HTTPheader, "\r\nRange:")) == NULL || strcasestr(HTTPheader, "\r\nIf-Range:"))
+        return NULL;
+    for (p += 8; *p == ' '; p++)
+        ;
+    return strncasecmp(p, "bytes=", 6) ? NULL : p + 6;
+}
+
+// 캐시 미스일 경우 연결 풀에서 서버 연결을 얻어 요청을 보내고, 응답을 클라이언트에게 중계하면서 캐시에 저장함.
+// 클라이언트 연결을 닫아야 하면 *keepalive를 0으로 바꾸고, 응답을 캐시에 저장했는지를 fill 결과로 리턴함
+static fill_state fetch_response(int connfd, fill_t *f, char *uri, char *hostname, char *portch, char *HTTPheader, int client11, int *keepalive)
+{
+    char buf[MAXLINE];
+    int EndServerfd, ok, reused;
+    rio_t serv_rio;
+
+    // 풀에서 꺼낸 연결은 서버가 유휴 연결을 닫는 것과 요청이 엇갈려 응답 없이 끊길 수 있음.
+    // GET은 다시 보내도 안전하므로 응답 첫 줄을 받지 못하면 다른 연결로 다시 시도하고, 새로 맺은 연결에서 실패하면 포기함
+    while (1)
+    {
+        if ((EndServerfd = pool_checkout(hostname, portch, &reused)) < 0)
+        {
+            printf("connection failed\n");
+            *keepalive = 0;
+            return FILL_FAILED;
+        }
+        Rio_readinitb(&serv_rio, EndServerfd);
+        if (client_write(EndServerfd, HTTPheader, strlen(HTTPheader))
+                && rio_readlineb(&serv_rio, buf, MAXLINE) > 0)
+            break;
+        Close(EndServerfd);
+        if (!reused)
+        {
+            printf("bad response from server\n");
+            *keepalive = 0;
+            return FILL_FAILED;
+        }
+    }
+    
+    // fill에 합류한 스레드가 따라 읽을 수 있도록 fetcher는 fill의 버퍼에 응답을 모음
+    char localbuf[MAX_OBJECT_SIZE], *cachebuf = f ? f->buf : localbuf;
+    char block[RELAY_BLOCK], extra[64], chunkhdr[32];
+    struct iovec iov[3];
+    size_t sizebuf = 0, hdrlen;
+    long content_length = -1;
+    ssize_t n;
+    int status = 0, chunked = 0, complete = 0, nobody, upstream_keepalive = 0, upstream_chunked = 0;
+    int cacheable = 1; // 저장해도 되는 응답이고 전체가 MAX_OBJECT_SIZE 미만인 동안 1
+    http_fresh fresh;
+    time_t expires;    // 캐시에 저장할 항목의 만료 시각. 저장하면 안 되는 응답이면 0
+    int sending = 1;   // 클라이언트에게 보내는 중이면 1
+    large_obj *lo = NULL; // 큰 객체 캐시에 저장할 응답이면 본문을 받을 객체
+    char *dst;
+    size_t room;
+    body_t body;
+
+    // 응답 상태줄과 헤더는 한 줄씩 읽어 cachebuf에 모음.
+    // 상태줄은 프록시의 버전(HTTP/1.1)으로 바꾸고, hop-by-hop 헤더는 버린 뒤 클라이언트 연결에 맞게 다시 붙임
+    n = strlen(buf);
+    fresh_init(&fresh);
+    do
+    {
+        if (!strcmp(buf, "\r\n"))
+        {
+            complete = 1;
+            break;
+        }
+        if (sizebuf > 0)
+            fresh_header(&fresh, buf);
+        if (sizebuf == 0)
+        {
+            sscanf(buf, "%*s %d", &status);
+            // HTTP/1.1 서버는 Connection: close를 보내지 않는 한 연결을 유지하고, HTTP/1.0 서버는 keep-alive를 보낸 경우만 유지함
+            upstream_keepalive = !strncmp(buf, "HTTP/1.1 ", 9);
+            if (!strncmp(buf, "HTTP/1.0 ", 9))
+                buf[7] = '1';
+        }
+        else if (!strncasecmp(buf, "Content-length:", 15))
+            content_length = atol(buf + 15);
+        else if (!strncasecmp(buf, "Transfer-Encoding:", 18) && strcasestr(buf + 18, "chunked"))
+        {
+            // 청크는 여기서 풀고, 클라이언트에게 보낼 때 필요하면 다시 chunked로 감쌈
+            upstream_chunked = 1;
+            continue;
+        }
+        else if (is_hop_header(buf))
+        {
+            if (!strncasecmp(buf, "Connection:", 11) && strcasestr(buf, "close"))
+                upstream_keepalive = 0;
+            else if (!strncasecmp(buf, "Connection:", 11) && strcasestr(buf, "keep-alive"))
+                upstream_keepalive = 1;
+            continue;
+        }
+        if (sizebuf + n + 2 >= MAX_OBJECT_SIZE)
+            break;
+        memcpy(cachebuf + sizebuf, buf, n);
+        sizebuf = sizebuf + n;
+    } while ((n = rio_readlineb(&serv_rio, buf, MAXLINE)) > 0);
+    if (!complete)
+    {
+        // 헤더가 끝나기 전에 서버가 연결을 끊었거나 헤더가 너무 큼
+        printf("bad response from server\n");
+        Close(EndServerfd);
+        *keepalive = 0;
+        return FILL_FAILED;
+    }
+    hdrlen = sizebuf;
+    // 상태 코드와 캐시 관련 헤더로 저장해도 되는지 정함. 저장하지 않을 응답은 캐시 버퍼를 거치지 않고 중계함
+    fresh.status = status;
+    if ((expires = fresh_expiry(&fresh, time(NULL))) == 0)
+        cacheable = 0;
+
+    // 본문 길이: 본문이 없는 상태 코드는 0, chunked면 마지막 청크까지, 그 외에는 Content-length, 없으면 EOF까지
+    nobody = status / 100 == 1 || status == 204 || status == 304;
+    memset(&body, 0, sizeof(body_t));
+    body.chunked = !nobody && upstream_chunked;
+    body.remaining = (nobody || body.chunked) ? 0 : content_length;
+    body.done = nobody || (!body.chunked && body.remaining == 0);
+    // EOF로 끝나는 본문을 받은 연결은 다시 쓸 수 없음
+    if (!nobody && !body.chunked && content_length < 0)
+        upstream_keepalive = 0;
+    // 길이를 모르는 본문은 HTTP/1.1 클라이언트에게는 chunked로 보내고, 아니면 연결을 닫아 끝을 알림
+    if (!nobody && (body.chunked || content_length < 0))
+    {
+        if (*keepalive && client11)
+            chunked = 1;
+        else
+            *keepalive = 0;
+    }
+    sprintf(extra, "%s%s\r\n", chunked ? "Transfer-Encoding: chunked\r\n" : "",
+            *keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    iov[0].iov_base = cachebuf;
+    iov[0].iov_len = hdrlen;
+    iov[1].iov_base = extra;
+    iov[1].iov_len = strlen(extra);
+    if (!client_writev(connfd, iov, 2))
+    {
+        Close(EndServerfd);
+        *keepalive = 0;
+        return FILL_FAILED;
+    }
+    printf("proxy received %zu header bytes, then send\n", hdrlen);
+    // 캐시에 저장할 응답은 hop-by-hop 헤더 없이 빈 줄로 헤더를 끝냄
+    memcpy(cachebuf + sizebuf, "\r\n", 2);
+    sizebuf = sizebuf + 2;
+    if (body.remaining > 0 && sizebuf + body.remaining >= MAX_OBJECT_SIZE)
+    {
+        cacheable = 0;
+        // 길이를 아는 큰 200 응답은 저장해도 되면 본문을 세그먼트에 받아 큰 객체 캐시에 저장함
+        if (status == 200 && expires && body.remaining <= LARGE_OBJECT_MAX)
+            lo = large_begin(uri, cachebuf, hdrlen, body.remaining, expires);
+    }
+    // 다 받았을 때의 길이를 미리 알 수 있는 응답만 기다리는 스레드가 따라가며 보낼 수 있음
+    if (f)
+        fill_headers(f, hdrlen, (lo || cacheable) && !body.chunked && (nobody || content_length >= 0)
+                                    ? sizebuf + body.remaining : 0, lo, lo || cacheable);
+
+    // 본문은 줄 단위가 아니라 도착하는 대로 최대 RELAY_BLOCK 크기씩 읽어 전달함.
+    // 캐시할 수 없고 청크를 풀거나 감쌀 필요도 없는 나머지는 아래에서 splice로 넘김
+    n = 0;
+    while (!body.done && (cacheable || lo || chunked || body.chunked))
+    {
+        // 큰 객체는 본문을 세그먼트에 바로 읽어 들임
+        dst = block;
+        room = RELAY_BLOCK;
+        if (lo)
+            dst = large_segment(lo, sizebuf - hdrlen - 2, &room);
+        if ((n = body_read(&body, &serv_rio, dst, room)) <= 0)
+            break;
+        if (!sending)
+            ok = 1;
+        else if (chunked)
+        {
+            sprintf(chunkhdr, "%zx\r\n", (size_t)n);
+            iov[0].iov_base = chunkhdr;
+            iov[0].iov_len = strlen(chunkhdr);
+            iov[1].iov_base = block;
+            iov[1].iov_len = n;
+            iov[2].iov_base = "\r\n";
+            iov[2].iov_len = 2;
+            ok = client_writev(connfd, iov, 3);
+        }
+        else
+            ok = client_write(connfd, dst, n);
+        if (!ok)
+        {
+            // 클라이언트가 끊겨도 캐시할 응답이면 따라 받는 스레드와 캐시를 위해 끝까지 읽음
+            *keepalive = 0;
+            sending = 0;
+            if (!f || !(cacheable || lo))
+            {
+                Close(EndServerfd);
+                if (lo)
+                    large_put(lo);
+                return FILL_FAILED;
+            }
+        }
+        if (cacheable && sizebuf + n < MAX_OBJECT_SIZE)
+            memcpy(cachebuf + sizebuf, block, n);
+        else if (cacheable)
+        {
+            // 길이를 모르던 응답이 MAX_OBJECT_SIZE를 넘었으면 기다리던 스레드를 바로 보냄
+            cacheable = 0;
+            if (f)
+                fill_uncacheable(f);
+        }
+        sizebuf = sizebuf + n;
+        if (f && (cacheable || lo))
+            fill_progress(f, sizebuf);
+    }
+    if (!body.done && n >= 0 && !cacheable && !lo && !chunked && !body.chunked)
+    {
+        // rio 내부 버퍼에 남은 바이트를 먼저 보내고, 나머지는 유저 공간을 거치지 않고 splice로 전달함
+        if ((n = rio_splicenb(&serv_rio, connfd, body.remaining)) < 0)
+            printf("relay failed: %s\n", strerror(errno));
+        else
+        {
+            sizebuf = sizebuf + n;
+            if (body.remaining < 0 || n == body.remaining)
+                body.done = 1;
+        }
+    }
+    // 본문을 끝까지 읽었고 서버가 연결 유지를 허락했으며 다음 응답의 바이트가 rio 버퍼에 섞여 있지 않으면 풀에 돌려줌
+    if (body.done && upstream_keepalive && serv_rio.rio_cnt == 0)
+        pool_checkin(hostname, portch, EndServerfd);
+    else
+        Close(EndServerfd);
+    if (chunked && sending && body.done && !client_write(connfd, "0\r\n\r\n", 5))
+        *keepalive = 0;
+    printf("proxy relayed %zu bytes\n", sizebuf);
+    // 서버가 본문을 다 보내기 전에 끊었으면 클라이언트도 응답의 끝을 알 수 없으므로 연결을 닫고, 캐시하지도 않음
+    if (!body.done)
+    {
+        *keepalive = 0;
+        if (lo)
+            large_put(lo);
+        return FILL_FAILED;
+    }
+    if (lo)
+    {
+        large_store(lo);
+        large_put(lo);
+        return FILL_CACHED;
+    }
 
-// main function
-// 프록시 서버 과제의 sequantial 및 concurrent와 관련된 주석은 생략함.
-int main(int argc, char **argv)
+    if (cacheable && content_length < 0)
+    {
+        // 캐시된 응답은 keep-alive 연결에서 그대로 보낼 수 있도록 받은 길이로 Content-length를 붙여 둠
+        n = sprintf(extra, "Content-length: %zu\r\n", sizebuf - hdrlen - 2);
+        if (sizebuf + n < MAX_OBJECT_SIZE)
+        {
+            memmove(cachebuf + hdrlen + n, cachebuf + hdrlen, sizebuf - hdrlen);
+            memcpy(cachebuf + hdrlen, extra, n);
+            sizebuf = sizebuf + n;
+        }
+        else
+            cacheable = 0;
+    }
+    if (cacheable)
+    {
+        // 저장해도 되는 응답이고 전체가 MAX_OBJECT_SIZE보다 작을 경우만 캐시에 저장함
+        cache_uri(&cache, uri, cachebuf, sizebuf, expires);
+        return FILL_CACHED;
+    }
+    return FILL_UNCACHEABLE;
+}
+
+// 요청 하나를 처리함. 같은 연결에서 다음 요청을 받을 수 있으면 1, 연결을 닫아야 하면 0을 리턴함.
+// last가 1이면 이 요청을 마지막으로 연결을 닫음
+int doit(int connfd, rio_t *rio, int last)
 {
-    int listenfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
-    cache_init(); 
-    if (argc != 2)
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char HTTPheader[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+    char portch[10];
+    int keepalive, client11, ok, fetcher, rc, lookups = 0;
+    char *range;
+    fill_t *f = NULL;
+    fill_state st;
+    
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+        return 0;
+    printf("Request headers:\n");
+    printf("%s", buf);
+    method[0] = uri[0] = version[0] = '\0';
+    sscanf(buf, "%s %s %s", method, uri, version);
+
+    if (strcasecmp(method, "GET"))
+    {
+        printf("Proxy does not implement this method\n");
+        return 0;
+    }
+    // 캐시와 fill의 키는 정규화한 uri
+    char uri_store[MAX_OBJECT_SIZE];
+    uri_normalize(uri, uri_store);
+    if (trace_fp)
+        fprintf(trace_fp, "GET %s\n", uri_store);
+    int port;
+
+    // 다음 요청을 읽으려면 이번 요청의 헤더를 모두 읽어야 하므로 캐시 확인 전에 헤더를 먼저 처리함
+    // HTTP/1.1 클라이언트는 기본적으로 연결을 유지하고, HTTP/1.0은 keep-alive를 요청한 경우에만 유지함
+    client11 = !strcasecmp(version, "HTTP/1.1");
+    keepalive = client11;
+    parse_uri(uri, hostname, path, &port);
+    if ((rc = makeHTTPheader(HTTPheader, hostname, path, port, rio, &keepalive, 1)) < 0)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+        // 헤더가 너무 크면 남은 헤더를 읽지 않았으므로 431로 답하고 연결을 닫음
+        if (rc == -1)
+            client_write(connfd, (void *)too_large_response, strlen(too_large_response));
+        return 0;
     }
-    listenfd = Open_listenfd(argv[1]);
+    range = request_range(HTTPheader);
+    if (last)
+        keepalive = 0;
+
+    // 캐시를 확인하고, 미스면 같은 uri를 이미 가져오고 있는 스레드가 있는지 확인함.
+    // 있으면 fetcher가 받는 응답을 따라가며 보내거나, 따라갈 수 없는 응답이면 끝날 때까지 기다렸다가 캐시에서 꺼내 보냄.
+    // 없으면 이 스레드가 fetcher가 되어 서버에 요청함.
+    // fetcher가 실패하면 기다리던 스레드 중 하나가 다시 fetcher가 되고, 캐시할 수 없는 응답이면 각자 서버에 요청함
     while (1)
     {
-        clientlen = sizeof(clientaddr);
-        int *connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, thread_routine, connfdp);
+        if (serve_cached(connfd, uri_store, range, keepalive, lookups++ == 0, &ok))
+            return ok && keepalive;
+        f = fill_join(uri_store, &fetcher);
+        if (fetcher)
+            break;
+        if ((st = fill_wait(f, connfd, &keepalive)) == FILL_STREAMED)
+            return keepalive;
+        if (st == FILL_UNCACHEABLE)
+        {
+            f = NULL;
+            break;
+        }
     }
-    return 0;
+    // 캐시를 확인한 뒤 fill을 등록하기 전에 다른 fetcher가 저장을 끝냈을 수 있으므로 한 번 더 확인함
+    if (f && serve_cached(connfd, uri_store, range, keepalive, 0, &ok))
+    {
+        fill_finish(f, FILL_CACHED);
+        return ok && keepalive;
+    }
+
+    sprintf(portch, "%d", port);
+    st = fetch_response(connfd, f, uri_store, hostname, portch, HTTPheader, client11, &keepalive);
+    if (f)
+        fill_finish(f, st);
+    return keepalive;
 }
 
-void *thread_routine(void *connfdp)
+
+/*
+ * epoll 기반 이벤트 루프 (-e, -s 옵션)
+ * 연결마다 스레드를 만드는 대신 논블로킹 소켓과 연결별 상태 머신으로 하나의 스레드가 모든 연결을 처리함.
+ * 연결 상태는 요청 읽기 -> 서버 연결 -> 중계 -> 완료 순서로 진행되고,
+ * 요청 헤더가 모두 들어온 뒤에는 기존 doit과 동일하게 parse_uri와 makeHTTPheader로 서버 요청을 만듦.
+ * DNS 캐시에 없는 서버 이름은 루프를 막지 않도록 도우미 스레드가 조회하고, 끝나면 eventfd로 루프를 깨움.
+ * 요청 헤더 읽기, 서버 연결, 중계가 멈춘 연결은 마감 시각이 지나면 닫고, 가장 가까운 마감 시각을 epoll_wait 제한 시간으로 씀.
+ * -s 옵션을 주면 이 루프를 샤드 수만큼 스레드로 띄우고, 각 샤드는 자신의 SO_REUSEPORT 리스너에서만 accept함.
+ */
+#define EV_MAXEVENTS 1024
+#define EV_RELAYSIZE 16384 // 요청 헤더 버퍼(RIO_BUFSIZE + 1)와 중계 버퍼를 같은 크기로 씀
+#define EV_MAXFREEBUFS 256 // 샤드마다 재사용을 위해 들고 있을 버퍼 수
+#define EV_RESOLVERS 4     // 모든 샤드가 함께 쓰는 DNS 도우미 스레드 수
+#define EV_HEADER_TIMEOUT 10000  // 요청 헤더 제한 시간 (ms)
+#define EV_RESOLVE_TIMEOUT 10000 // DNS 조회 제한 시간 (ms)
+#define EV_CONNECT_TIMEOUT 3000  // 주소 하나에 connect하고 요청을 보낼 제한 시간 (ms). open_clientfd의 시도별 제한 시간과 같음
+#define EV_IDLE_TIMEOUT 60000    // 중계가 멈춘 채로 기다릴 시간 (ms)
+
+static const long long ev_timeouts[EV_NTIMERS] = {EV_HEADER_TIMEOUT, EV_RESOLVE_TIMEOUT, EV_CONNECT_TIMEOUT,
+                                                  EV_IDLE_TIMEOUT};
+
+typedef enum
 {
-    int connfd = *((int *)connfdp);
+    EV_READ_REQUEST,     // 클라이언트 요청 헤더가 빈 줄까지 모두 들어올 때까지 읽음
+    EV_RESOLVE,          // DNS 캐시에 없는 서버 이름을 도우미 스레드가 조회하는 중
+    EV_CONNECT_UPSTREAM, // 서버에 논블로킹 connect 후 요청 헤더 전송
+    EV_RELAY,            // 서버 응답(또는 캐시 객체)을 클라이언트에게 전달
+    EV_DONE
+} ev_state;
+
+struct ev_conn
+{
+    ev_state state;
+    shard_t *sh;                 // 이 연결을 처리하는 샤드
+    int clientfd, serverfd;
+    uint32_t clientev, serverev; // 현재 epoll에 등록된 관심 이벤트
+    char *req;                   // 요청 헤더 누적 버퍼
+    size_t reqlen;
+    char *uri;                   // 캐시 키
+    char *out;                   // 서버에 보낼 HTTPheader
+    size_t outlen, outpos;
+    struct addrinfo *addrs, *next_addr; // 아직 connect를 시도하지 않은 주소
+    char *buf;                   // 중계 버퍼
+    size_t buflen, bufpos;
+    cache_block *hit;            // 캐시 적중 시 찾은 항목. buf는 그 응답을 가리키고, 닫을 때 readend를 부름
+    int upstream_eof;
+    char *cachebuf;              // MAX_OBJECT_SIZE 미만인 동안 응답을 모아둠
+    size_t cachelen, cachecap;
+    int cacheable;
+    ev_dns *dns;                 // 도우미 스레드에 맡긴 DNS 조회. 끝나기 전에 연결을 닫으면 결과만 버림
+    int timer;                   // 걸려 있는 마감 시각 종류. 없으면 -1
+    long long armed;             // 마감 시각을 건 시각 (ms)
+    ev_conn *tprev, *tnext;      // 같은 종류의 마감 시각 목록
+};
+
+// 도우미 스레드에 맡긴 DNS 조회 하나. 루프 스레드만 c를 읽고 바꿈
+struct ev_dns
+{
+    ev_conn *c;                  // 결과를 기다리는 연결. 연결이 먼저 닫히면 NULL
+    shard_t *sh;                 // 결과를 돌려받을 샤드
+    char hostname[MAXLINE], port[10];
+    struct addrinfo *addrs;
+    int rc;
+    ev_dns *next;
+};
+
+// 모든 샤드의 조회 요청이 들어오는 큐
+static struct
+{
+    ev_dns *head, *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ev_resolveq = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static ev_conn **ev_fdtab; // fd -> 해당 fd를 사용하는 연결. fd는 프로세스 전체에서 유일하므로 샤드끼리 공유함
+static int ev_fdmax;
+
+// DNS 도우미 스레드. 큐에서 조회를 하나씩 꺼내 dns_getaddrinfo로 풀고(같은 이름은 DNS 캐시가 한 번만 조회함),
+// 결과를 요청한 샤드의 완료 목록에 넣은 뒤 eventfd로 그 샤드의 루프를 깨움
+static void *ev_resolver_routine(void *vargp)
+{
+    uint64_t one = 1;
+    shard_t *sh;
+    ev_dns *d;
+
     Pthread_detach(pthread_self());
-    Free(connfdp);
-    doit(connfd);
-    Close(connfd);
+    while (1)
+    {
+        pthread_mutex_lock(&ev_resolveq.lock);
+        while (ev_resolveq.head == NULL)
+            pthread_cond_wait(&ev_resolveq.cond, &ev_resolveq.lock);
+        d = ev_resolveq.head;
+        if ((ev_resolveq.head = d->next) == NULL)
+            ev_resolveq.tail = NULL;
+        pthread_mutex_unlock(&ev_resolveq.lock);
+
+        if ((d->rc = dns_getaddrinfo(d->hostname, d->port, &d->addrs)) != 0)
+            d->addrs = NULL;
+        sh = d->sh;
+        pthread_mutex_lock(&sh->dnslock);
+        d->next = sh->dnsdone;
+        sh->dnsdone = d;
+        pthread_mutex_unlock(&sh->dnslock);
+        if (write(sh->dnsfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            unix_error("eventfd write error");
+    }
+    return NULL;
 }
 
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-// 오브젝트 최대갯수는 캐시용량과 오브젝트 용량으로 결정됨
-#define MAX_OBJECT_NUM ((int)(MAX_CACHE_SIZE / MAX_OBJECT_SIZE))
+// 만 개 이상의 연결을 받을 수 있도록 열 수 있는 fd 수를 hard limit까지 올리고 DNS 도우미 스레드를 띄움
+void event_init()
+{
+    struct rlimit rl;
+    pthread_t tid;
+    int i;
+    Signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        unix_error("getrlimit error");
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        getrlimit(RLIMIT_NOFILE, &rl);
+    ev_fdmax = (rl.rlim_cur > (1 << 20)) ? (1 << 20) : (int)rl.rlim_cur;
+    ev_fdtab = Calloc(ev_fdmax, sizeof(ev_conn *));
+    for (i = 0; i < EV_RESOLVERS; i = i + 1)
+        Pthread_create(&tid, NULL, ev_resolver_routine, NULL);
+}
 
-typedef struct 
+// 단조 시계의 현재 시각 (ms)
+static long long ev_clock()
 {
-    char cache_obj[MAX_OBJECT_SIZE];
-    char cache_uri[MAXLINE];
-    int order; // LRU order
-    int alloc, read;
-    // read 및 write 읽기 및 쓰기 권한 관련 세마포어 선언
-    sem_t ws, rs;
-} cache_block;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-typedef struct
+// 연결을 마감 시각 목록에서 뺌
+static void ev_timer_stop(ev_conn *c)
 {
-    cache_block cacheOBJ[MAX_OBJECT_NUM];
+    shard_t *sh = c->sh;
+    if (c->timer < 0)
+        return;
+    if (c->tprev)
+        c->tprev->tnext = c->tnext;
+    else
+        sh->timers[c->timer] = c->tnext;
+    if (c->tnext)
+        c->tnext->tprev = c->tprev;
+    else
+        sh->timertails[c->timer] = c->tprev;
+    c->tprev = c->tnext = NULL;
+    c->timer = -1;
+}
 
-} Cache;
+// 지금부터 kind의 제한 시간이 지나면 연결을 닫도록 마감 시각을 다시 검.
+// 같은 종류는 제한 시간이 같으므로 목록 끝에 붙이기만 해도 마감 순서가 유지됨
+static void ev_timer_start(ev_conn *c, ev_timer kind)
+{
+    shard_t *sh = c->sh;
+    ev_timer_stop(c);
+    c->timer = kind;
+    c->armed = sh->now;
+    c->tprev = sh->timertails[kind];
+    if (c->tprev)
+        c->tprev->tnext = c;
+    else
+        sh->timers[kind] = c;
+    sh->timertails[kind] = c;
+}
 
-// cache 구조체 선언
-Cache cache;
+static char *ev_getbuf(shard_t *sh)
+{
+    if (sh->nfree > 0)
+        return sh->freebufs[--sh->nfree];
+    return Malloc(EV_RELAYSIZE);
+}
 
-// 캐시 블록 별 인자들 초기화
-void cache_init()
+static void ev_putbuf(shard_t *sh, char *buf)
 {
-    int index = 0;
-    for (; index < MAX_OBJECT_NUM; index = index + 1)
-    {
-        cache.cacheOBJ[index].order = 0; // 캐시에 새로운 내용을 덮어씌울 때 사용한지 가장 오래된 index를 찾기 위한 인자
-        cache.cacheOBJ[index].alloc = 0; // 해당 블록의 할당 여부를 판단하기 위한 인자
-        Sem_init(&cache.cacheOBJ[index].ws, 0, 1); // 해당 블록의 쓰기 권한 관련 세마포어
-        Sem_init(&cache.cacheOBJ[index].rs, 0, 1); // 해당 블록의 읽기 권한 관련 세마포어
-        cache.cacheOBJ[index].read = 0; // 현재 블록을 읽고 있는 쓰레드의 숫자
-    }
+    if (buf == NULL)
+        return;
+    if (sh->nfree < EV_MAXFREEBUFS)
+        sh->freebufs[sh->nfree++] = buf;
+    else
+        free(buf);
+}
+
+// fd의 관심 이벤트가 바뀐 경우에만 epoll_ctl을 호출함
+static void ev_watch(ev_conn *c, int fd, uint32_t *cur, uint32_t events)
+{
+    struct epoll_event ev;
+    if (fd < 0 || *cur == events)
+        return;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(c->sh->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    *cur = events;
+}
+
+static void ev_register(ev_conn *c, int fd, uint32_t *cur, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(c->sh->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    *cur = events;
+    ev_fdtab[fd] = c;
+}
+
+static void ev_close_server(ev_conn *c)
+{
+    if (c->serverfd < 0)
+        return;
+    ev_fdtab[c->serverfd] = NULL;
+    close(c->serverfd); // close하면 epoll 관심 목록에서도 빠짐
+    c->serverfd = -1;
+    c->serverev = 0;
 }
 
-// 캐시를 읽기 전 세마포어를 확인하여 타 스레드로부터 보호함
-void readstart(int index)
-{   
-    // 쓰기 권한을 확인하는 과정에서 타 쓰레드에 의해 read가 변동되는 것을 방지하기 위해 읽기 권한을 제한함
-    P(&cache.cacheOBJ[index].rs); 
-    cache.cacheOBJ[index].read += 1;
-    // +1한 값이 1이라면 현재 해당 캐시블록을 읽고 있는 쓰레드가 없어 타 쓰레드가 write를 위해 접근할 수 있음.
-    // 따라서, 해당 블록의 쓰기 권한을 제한함
-    if (cache.cacheOBJ[index].read == 1)
-        P(&cache.cacheOBJ[index].ws);
-    V(&cache.cacheOBJ[index].rs); // 쓰기 권한 부여
+static void ev_close(ev_conn *c)
+{
+    ev_timer_stop(c);
+    if (c->dns)
+        c->dns->c = NULL;
+    ev_close_server(c);
+    ev_fdtab[c->clientfd] = NULL;
+    close(c->clientfd);
+    if (c->addrs)
+        dns_freeaddrinfo(c->addrs);
+    ev_putbuf(c->sh, c->req);
+    if (c->hit)
+        readend(c->hit);
+    else
+        ev_putbuf(c->sh, c->buf);
+    free(c->uri);
+    free(c->out);
+    free(c->cachebuf);
+    free(c);
 }
 
-// readstart의 역연산
-void readend(int index)
+// 캐시 저장용 버퍼의 cachelen 위치에 응답을 이어 붙임. 응답은 NUL을 포함할 수 있으므로 길이로만 다룸.
+// MAX_OBJECT_SIZE를 넘으면 캐시하지 않음
+static void ev_cache_append(ev_conn *c, char *data, size_t n)
 {
-    P(&cache.cacheOBJ[index].rs);
-    cache.cacheOBJ[index].read -= 1;
-    // 현재 read 값에서 1을 뺀 값이 0인 경우, 현재 이 블록을 읽고 있는 쓰레드가 자신 밖에 없으므로
-    // 해당 블록의 쓰기 권한을 다시 부여해줌
-    if (cache.cacheOBJ[index].read == 0)
-        V(&cache.cacheOBJ[index].ws);
-    V(&cache.cacheOBJ[index].rs);
+    if (!c->cacheable)
+        return;
+    if (c->cachelen + n >= MAX_OBJECT_SIZE)
+    {
+        c->cacheable = 0;
+        free(c->cachebuf);
+        c->cachebuf = NULL;
+        return;
+    }
+    if (c->cachelen + n > c->cachecap)
+    {
+        c->cachecap = c->cachecap ? c->cachecap * 2 : EV_RELAYSIZE;
+        if (c->cachecap > MAX_OBJECT_SIZE)
+            c->cachecap = MAX_OBJECT_SIZE;
+        c->cachebuf = Realloc(c->cachebuf, c->cachecap);
+    }
+    memcpy(c->cachebuf + c->cachelen, data, n);
+    c->cachelen += n;
 }
 
-// 필요한 정보를 담은 캐시가 존재하는지 확인하고 있다면 인덱스를 리턴함.
-int cache_find(char *uri)
+// 다 받은 응답을 캐시에 저장해도 되는지 헤더로 정하고 만료 시각을 리턴함. 응답은 서버가 보낸 그대로 모아 두므로
+// fetch_response와 같은 규칙을 헤더 줄마다 적용하고, 본문이 Content-length보다 짧거나 마지막 청크가 없으면
+// 서버가 중간에 끊은 것이므로 저장하지 않음. 저장하면 안 되면 0
+static time_t ev_cache_expiry(ev_conn *c)
 {
-    int index = 0;
-    // 전체 캐시 블록에 대해 탐색함
-    for (; index < MAX_OBJECT_NUM; index = index + 1)
+    char line[MAXLINE], *p = c->cachebuf, *end = c->cachebuf + c->cachelen, *eol;
+    http_fresh fresh;
+    long content_length = -1;
+    int chunked = 0;
+    size_t n;
+
+    fresh_init(&fresh);
+    while (1)
     {
-        // 탐색 전 해당 인덱스의 쓰기 권한을 결정하기 위한 함수
-        readstart(index);
-        // 해당 블록이 할당 상태이고, 목표하는 정보를 갖고 있을 경우 캐시 히트이므로 break
-        if (cache.cacheOBJ[index].alloc && (strcmp(uri, cache.cacheOBJ[index].cache_uri) == 0))
+        if ((eol = memchr(p, '\n', end - p)) == NULL || (n = eol + 1 - p) >= MAXLINE)
+            return 0;
+        memcpy(line, p, n);
+        line[n] = '\0';
+        p = eol + 1;
+        if (fresh.status == 0)
+        {
+            if (sscanf(line, "HTTP/%*s %d", &fresh.status) != 1)
+                return 0;
+        }
+        else if (!strcmp(line, "\r\n"))
             break;
-        readend(index);
+        else if (!strncasecmp(line, "Content-length:", 15))
+            content_length = atol(line + 15);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line + 18, "chunked"))
+            chunked = 1;
+        else
+            fresh_header(&fresh, line);
+    }
+    if (chunked ? end - p < 5 || memcmp(end - 5, "0\r\n\r\n", 5) : content_length >= 0 && end - p != content_length)
+        return 0;
+    return fresh_expiry(&fresh, time(NULL));
+}
+
+// 중계 버퍼에 남은 내용을 클라이언트에게 최대한 보냄. 연결을 닫았으면 -1
+static int ev_flush(ev_conn *c)
+{
+    ssize_t n;
+    time_t expires;
+    while (c->bufpos < c->buflen)
+    {
+        n = send(c->clientfd, c->buf + c->bufpos, c->buflen - c->bufpos, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // 클라이언트가 느리면 서버 읽기를 멈추고 쓰기 가능해질 때까지 기다림
+                ev_watch(c, c->serverfd, &c->serverev, 0);
+                ev_watch(c, c->clientfd, &c->clientev, EPOLLOUT);
+                return 0;
+            }
+            if (errno == EINTR)
+                continue;
+            ev_close(c);
+            return -1;
+        }
+        c->bufpos += n;
+        c->sh->bytes += n;
+        ev_timer_start(c, EV_TIMER_IDLE);
     }
-    // 캐시 미스일 경우 -1 리턴
-    if (index == MAX_OBJECT_NUM)
+    c->bufpos = c->buflen = 0;
+    if (c->upstream_eof)
+    {
+        // 응답 전체를 보냈으므로 doit과 같은 조건으로 캐시에 저장하고 연결 종료
+        c->state = EV_DONE;
+        if (c->cacheable && c->cachebuf && (expires = ev_cache_expiry(c)) != 0)
+            cache_uri(c->sh->cache, c->uri, c->cachebuf, c->cachelen, expires);
+        ev_close(c);
         return -1;
-    // 캐시 히트일 경우 해당 인덱스 리턴
-    return index;
+    }
+    ev_watch(c, c->clientfd, &c->clientev, 0);
+    ev_watch(c, c->serverfd, &c->serverev, EPOLLIN);
+    return 0;
 }
 
-// 빈 캐시, 혹은 사용한지 가장 오래된 캐시 차출
-int cache_eviction()
+// 남은 주소 목록에서 논블로킹 connect를 시작하고, 이 주소에 대한 마감 시각을 검
+static void ev_connect_next(ev_conn *c)
 {
-    //minorder는 MAX 값에서 자신보다 작은 값으로 계속 갱신됨
-    int minorder = MAX_OBJECT_NUM + 1;
-    int minindex = 0;
-    int index = 0;
-    // 모든 index를 탐색하며 비교
-    for (; index < MAX_OBJECT_NUM; index = index + 1)
+    struct addrinfo *p;
+    int fd;
+    while ((p = c->next_addr) != NULL)
     {
-        readstart(index);
-        // 할당되지 않은 블록을 발견하면 탐색을 중단하고 index를 return
-        if (!cache.cacheOBJ[index].alloc)
+        c->next_addr = p->ai_next;
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+        if (fd >= ev_fdmax)
         {
-            readend(index);
-            return index;
+            close(fd);
+            break;
         }
-        // 빈 캐시를 발견하지 못하는 동안 minorder보다 작을 경우 minorder 및 해당 minindex 갱신.
-        if (cache.cacheOBJ[index].order < minorder)
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS)
         {
-            minindex = index;
-            minorder = cache.cacheOBJ[index].order;
+            close(fd);
+            continue;
         }
-    readend(index);
+        c->serverfd = fd;
+        c->state = EV_CONNECT_UPSTREAM;
+        c->outpos = 0;
+        ev_register(c, fd, &c->serverev, EPOLLOUT);
+        ev_timer_start(c, EV_TIMER_CONNECT);
+        return;
+    }
+    printf("connection failed\n");
+    ev_close(c);
+}
+
+// 조회 결과로 서버 연결을 시작함. addrs는 연결이 가져가고 닫을 때 놓아 줌
+static void ev_connect_start(ev_conn *c, int rc, struct addrinfo *addrs)
+{
+    if (rc != 0)
+    {
+        printf("connection failed\n");
+        ev_close(c);
+        return;
     }
-    // 빈 캐시가 존재하지 않을 경우 order가 가장 낮은 값의 index를 리턴함
-    return minindex;
+    c->addrs = c->next_addr = addrs;
+    ev_connect_next(c);
+}
+
+// DNS 캐시에 없는 이름은 도우미 스레드에 맡기고, 결과가 올 때까지 연결은 마감 시각 외의 이벤트를 받지 않음
+static void ev_resolve(ev_conn *c, char *hostname, char *port)
+{
+    ev_dns *d = Calloc(1, sizeof(ev_dns));
+
+    d->c = c;
+    d->sh = c->sh;
+    strcpy(d->hostname, hostname);
+    strcpy(d->port, port);
+    c->dns = d;
+    c->state = EV_RESOLVE;
+    pthread_mutex_lock(&ev_resolveq.lock);
+    if (ev_resolveq.tail)
+        ev_resolveq.tail->next = d;
+    else
+        ev_resolveq.head = d;
+    ev_resolveq.tail = d;
+    pthread_cond_signal(&ev_resolveq.cond);
+    pthread_mutex_unlock(&ev_resolveq.lock);
 }
 
-// LRU order를 재정렬하는 함수
-void cache_reorder(int target)
+// eventfd가 깨우면 조회를 마친 목록을 가져와, 아직 열려 있는 연결은 서버 연결을 시작하고 이미 닫힌 연결의 결과는 버림
+static void ev_on_resolved(shard_t *sh)
 {
-    // 방금 쓴 target index의 order를 최대값으로 초기화
-    cache.cacheOBJ[target].order = MAX_OBJECT_NUM + 1;
-    int index = 0;
-    // 타겟값을 제외하고 모든 index의 order에서 1을 빼줌
-    for (; index < MAX_OBJECT_NUM; index += 1)
+    uint64_t n;
+    ev_dns *d, *next;
+    ev_conn *c;
+
+    if (read(sh->dnsfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    pthread_mutex_lock(&sh->dnslock);
+    d = sh->dnsdone;
+    sh->dnsdone = NULL;
+    pthread_mutex_unlock(&sh->dnslock);
+    for (; d; d = next)
     {
-        if (index != target) // index가 target이 아닌 경우
+        next = d->next;
+        if ((c = d->c) != NULL)
         {
-            P(&cache.cacheOBJ[index].ws);
-            cache.cacheOBJ[index].order -= 1;
-            V(&cache.cacheOBJ[index].ws);
+            c->dns = NULL;
+            ev_connect_start(c, d->rc, d->addrs);
         }
+        else if (d->addrs)
+            dns_freeaddrinfo(d->addrs);
+        free(d);
     }
 }
 
-// cache_eviction으로 차출된 캐시에 uri와 buf를 저장
-void cache_uri(char *uri, char *buf)
+// 마감 시각이 지난 연결을 닫고, 다음 마감 시각까지 남은 시간(ms)을 리턴함. 걸린 마감 시각이 없으면 -1.
+// 서버 연결 중에 마감 시각이 지났으면 닫는 대신 다음 주소로 넘어가는데, ev_connect_next가 마감 시각을 새로 걸어
+// 목록 끝으로 옮기므로 이 연결을 다시 만나지 않음
+static int ev_expire(shard_t *sh)
 {
-    // 받아온 인자를 캐시에 저장하기 위해 할당되지 않은 블록 혹은 사용한지 가장 오래된 블록을 차출함
-    int index = cache_eviction();
-    // 해당 캐시 블록에 인자값 저장하기 전에 타 쓰레드의 쓰기 권한 제한
-    P(&cache.cacheOBJ[index].ws);
-    // buf, uri 값 copy
-    strcpy(cache.cacheOBJ[index].cache_obj, buf);
-    strcpy(cache.cacheOBJ[index].cache_uri, uri);
-    cache.cacheOBJ[index].alloc = 1; // 할당된 상태로 수정
-    // LRU order 재정렬
-    cache_reorder(index);
-    V(&cache.cacheOBJ[index].ws);
+    long long wait = -1, left;
+    ev_conn *c;
+    int kind;
+
+    for (kind = 0; kind < EV_NTIMERS; kind = kind + 1)
+    {
+        while ((c = sh->timers[kind]) != NULL && (left = c->armed + ev_timeouts[kind] - sh->now) <= 0)
+        {
+            sh->timeouts++;
+            if (kind == EV_TIMER_CONNECT && c->next_addr)
+            {
+                ev_close_server(c);
+                ev_connect_next(c);
+            }
+            else
+                ev_close(c);
+        }
+        if (c != NULL && (wait < 0 || left < wait))
+            wait = left;
+    }
+    return (int)wait;
 }
 
-void doit(int connfd)
+// 요청 헤더가 모두 들어오면 doit과 같은 방식으로 캐시를 확인하고, 미스면 서버 연결을 시작함
+static void ev_start(ev_conn *c)
 {
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char HTTPheader[MAXLINE], hostname[MAXLINE], path[MAXLINE];
-    int EndServerfd;
-    rio_t rio, serv_rio;
-    
-    Rio_readinitb(&rio, connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    printf("Request headers:\n");
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    char HTTPheader[MAXLINE], hostname[MAXLINE], path[MAXLINE], portch[10];
+    Cache *cp = c->sh->cache;
+    rio_t rio;
+    struct addrinfo *addrs;
+    cache_block *b;
+    int port, rc;
 
+    // 누적한 요청을 rio 내부 버퍼에 채워 넣어 기존 Rio_readlineb 기반 파싱 함수를 그대로 사용함.
+    // 버퍼에는 빈 줄까지 들어 있으므로 makeHTTPheader가 fd에서 더 읽으려고 하지 않음.
+    rio.rio_fd = -1;
+    memcpy(rio.rio_buf, c->req, c->reqlen);
+    rio.rio_cnt = c->reqlen;
+    rio.rio_bufptr = rio.rio_buf;
+    rio.rio_deadline = 0;
+    rio_readlineb(&rio, buf, MAXLINE);
+    method[0] = uri[0] = '\0';
+    sscanf(buf, "%s %s %s", method, uri, version);
     if (strcasecmp(method, "GET"))
     {
         printf("Proxy does not implement this method\n");
+        ev_close(c);
         return;
     }
-    char uri_store[MAX_OBJECT_SIZE];
-    strcpy(uri_store, uri);
-    int cache_index;
+    c->sh->requests++;
+    uri_normalize(uri, buf);
+    c->uri = strdup(buf);
 
-    // 캐시에 해당 url이 존재하는지 확인
-    if ((cache_index = cache_find(uri_store)) != -1)
+    if ((b = cache_find(cp, c->uri, 1)) != NULL)
     {
-        // 캐시 적중 시 클라이언트한테 보내고 doit 종료
-        readstart(cache_index);
-        Rio_writen(connfd, cache.cacheOBJ[cache_index].cache_obj, strlen(cache.cacheOBJ[cache_index].cache_obj));
-        readend(cache_index);
+        // 캐시 적중 시 항목을 복사하지 않고 중계 버퍼처럼 클라이언트에게 보냄. 항목은 연결을 닫을 때 놓아 줌
+        c->sh->hits++;
+        c->hit = b;
+        c->buf = b->cache_obj;
+        c->buflen = b->size;
+        c->upstream_eof = 1;
+        c->state = EV_RELAY;
+        ev_timer_start(c, EV_TIMER_IDLE);
+        ev_flush(c);
         return;
     }
-    int port;
+    c->sh->misses++;
 
-    // 캐시 미스일 경우, 기존의 프록시 서버와 동일하게 진행함.
     parse_uri(uri, hostname, path, &port);
-    makeHTTPheader(HTTPheader, hostname, path, port, &rio);
-
-    char portch[10];
+    if (makeHTTPheader(HTTPheader, hostname, path, port, &rio, NULL, 0) < 0)
+    {
+        send(c->clientfd, too_large_response, strlen(too_large_response), MSG_NOSIGNAL | MSG_DONTWAIT);
+        ev_close(c);
+        return;
+    }
+    c->out = strdup(HTTPheader);
+    c->outlen = strlen(HTTPheader);
     sprintf(portch, "%d", port);
-    
-    EndServerfd = Open_clientfd(hostname, portch);
-    if(EndServerfd < 0)
+
+    // 숫자 주소나 DNS 캐시에 있는 이름은 바로 연결하고, 조회가 필요하면 도우미 스레드에 맡겨 루프를 막지 않음
+    c->cacheable = 1;
+    ev_watch(c, c->clientfd, &c->clientev, 0);
+    ev_timer_start(c, EV_TIMER_RESOLVE);
+    if ((rc = dns_trygetaddrinfo(hostname, portch, &addrs)) == DNS_WOULDBLOCK)
+        ev_resolve(c, hostname, portch);
+    else
+        ev_connect_start(c, rc, addrs);
+}
+
+static void ev_on_request(ev_conn *c)
+{
+    ssize_t n;
+    while (1)
     {
-        printf("connection failed\n");
+        n = read(c->clientfd, c->req + c->reqlen, RIO_BUFSIZE - c->reqlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            ev_close(c);
+            return;
+        }
+        c->reqlen += n;
+        c->req[c->reqlen] = '\0';
+        if (strstr(c->req, "\r\n\r\n") != NULL)
+        {
+            ev_start(c);
+            return;
+        }
+        // rio 버퍼 한 개에 담기지 않는 요청 헤더는 처리하지 않음
+        if (c->reqlen == RIO_BUFSIZE)
+        {
+            send(c->clientfd, too_large_response, strlen(too_large_response), MSG_NOSIGNAL | MSG_DONTWAIT);
+            ev_close(c);
+            return;
+        }
+    }
+}
+
+static void ev_on_upstream(ev_conn *c)
+{
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    ssize_t n;
+
+    if (c->state == EV_CONNECT_UPSTREAM)
+    {
+        if (c->outpos == 0)
+        {
+            // connect 완료 여부 확인. 실패했으면 다음 주소로 다시 시도
+            if (getsockopt(c->serverfd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0)
+            {
+                ev_close_server(c);
+                ev_connect_next(c);
+                return;
+            }
+        }
+        while (c->outpos < c->outlen)
+        {
+            n = send(c->serverfd, c->out + c->outpos, c->outlen - c->outpos, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (n < 0)
+            {
+                ev_close(c);
+                return;
+            }
+            c->outpos += n;
+        }
+        c->state = EV_RELAY;
+        c->buf = ev_getbuf(c->sh);
+        ev_watch(c, c->serverfd, &c->serverev, EPOLLIN);
+        ev_timer_start(c, EV_TIMER_IDLE);
         return;
     }
-    Rio_readinitb(&serv_rio, EndServerfd);
-    Rio_writen(EndServerfd, HTTPheader, strlen(HTTPheader));
-    
-    char cachebuf[MAX_OBJECT_SIZE];
-    size_t sizerecvd, sizebuf = 0;
 
-    // 서버에서 받은 응답을 한줄씩 확인하여 캐시 블록 크기 내 범위에서 캐시에 저장함.
-    while((sizerecvd = Rio_readlineb(&serv_rio, buf, MAXLINE)) != 0)
+    // EV_RELAY: 중계 버퍼가 비어 있을 때만 서버로부터 읽음
+    n = read(c->serverfd, c->buf, EV_RELAYSIZE);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        ev_close(c);
+        return;
+    }
+    if (n == 0)
+    {
+        c->upstream_eof = 1;
+        ev_close_server(c);
+    }
+    else
+    {
+        c->buflen = n;
+        c->bufpos = 0;
+        ev_cache_append(c, c->buf, n);
+    }
+    ev_flush(c);
+}
+
+static void ev_accept(shard_t *sh)
+{
+    ev_conn *c;
+    int connfd;
+    while ((connfd = accept(sh->listenfd, NULL, NULL)) >= 0)
+    {
+        if (connfd >= ev_fdmax)
+        {
+            close(connfd);
+            continue;
+        }
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        sh->accepted++;
+        c = Calloc(1, sizeof(ev_conn));
+        c->state = EV_READ_REQUEST;
+        c->sh = sh;
+        c->clientfd = connfd;
+        c->serverfd = -1;
+        c->timer = -1;
+        c->req = ev_getbuf(sh);
+        ev_register(c, connfd, &c->clientev, EPOLLIN);
+        ev_timer_start(c, EV_TIMER_HEADER);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+        && errno != ECONNABORTED && errno != EMFILE && errno != ENFILE)
+        unix_error("accept error");
+}
+
+// event_init을 먼저 호출한 뒤 사용해야 함
+void event_loop(shard_t *sh)
+{
+    struct epoll_event ev, events[EV_MAXEVENTS];
+    ev_conn *c;
+    int n, i, fd, timeout;
+
+    sh->freebufs = Calloc(EV_MAXFREEBUFS, sizeof(char *));
+    if ((sh->epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    if ((sh->dnsfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        unix_error("eventfd error");
+    pthread_mutex_init(&sh->dnslock, NULL);
+    ev.events = EPOLLIN;
+    ev.data.fd = sh->dnsfd;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->dnsfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    fcntl(sh->listenfd, F_SETFL, fcntl(sh->listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = sh->listenfd;
+    if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, sh->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1)
     {
-        // 누적된 sizebuf가 MAX_OBJECT_SIZE보다 작으면 cachebuf에 이어 붙임
-        sizebuf = sizebuf + sizerecvd;
-        if (sizebuf < MAX_OBJECT_SIZE)
+        // 가장 가까운 마감 시각까지만 기다려, 이벤트가 없어도 제때 연결을 닫음
+        sh->now = ev_clock();
+        timeout = ev_expire(sh);
+        if ((n = epoll_wait(sh->epfd, events, EV_MAXEVENTS, timeout)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        sh->now = ev_clock();
+        for (i = 0; i < n; i = i + 1)
         {
-            strcat(cachebuf, buf);
+            fd = events[i].data.fd;
+            if (fd == sh->listenfd)
+            {
+                ev_accept(sh);
+                continue;
+            }
+            if (fd == sh->dnsfd)
+            {
+                ev_on_resolved(sh);
+                continue;
+            }
+            // 같은 루프에서 이미 닫힌 연결의 이벤트는 무시함
+            if ((c = ev_fdtab[fd]) == NULL)
+                continue;
+            if (fd == c->clientfd)
+            {
+                // HUP과 ERR는 관심 이벤트가 0이어도 계속 올라오므로, 상태와 상관없이 먼저 닫아야 루프가 헛돌지 않음
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                    ev_close(c);
+                else if (c->state == EV_READ_REQUEST)
+                    ev_on_request(c);
+                else if (c->state == EV_RELAY)
+                    ev_flush(c);
+            }
+            else
+                ev_on_upstream(c);
         }
-        printf("proxy received %d bytes, then send\n", sizerecvd);
-        // cache 크기와 관계없이 서버로부터 받은 응답은 모두 클라이언트에게 전송
-        Rio_writen(connfd, buf, sizerecvd);
     }
-    Close(EndServerfd);
-    if (sizebuf < MAX_OBJECT_SIZE)
+}
+
+static void *shard_routine(void *vargp)
+{
+    shard_t *sh = (shard_t *)vargp;
+    cpu_set_t set;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    if (sh->cpu >= 0)
     {
-        // sizebuf가 MAX_OBJECT_SIZE보다 작을 경우만 캐시에 저장함
-        cache_uri(uri_store, cachebuf);
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)) != 0)
+            posix_error(rc, "pthread_setaffinity_np error");
     }
+    event_loop(sh);
+    return NULL;
 }
 
+// 샤드마다 SO_REUSEPORT 리스너를 열어 커널이 연결을 샤드들에게 나눠주도록 함.
+// 캐시 용량은 샤드 수로 나눠 각 샤드가 자기 캐시만 사용하고, main 스레드는 SIGUSR1을 받으면 샤드별 통계를 출력함.
+void run_shards(char *port, int nshards, int pin)
+{
+    shard_t *shards = Calloc(nshards, sizeof(shard_t));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t mask;
+    pthread_t tid;
+    int i, sig;
+    char name[32];
+
+    if (ncpu < 1)
+        ncpu = 1;
+    // 샤드 스레드들이 SIGUSR1을 가로채지 않도록 만들기 전에 막아둠
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    event_init();
+    for (i = 0; i < nshards; i = i + 1)
+    {
+        shards[i].id = i;
+        shards[i].listenfd = Open_listenfd_reuseport(port);
+        shards[i].cpu = pin ? (int)(i % ncpu) : -1;
+        shards[i].cache = Malloc(sizeof(Cache));
+        cache_init(shards[i].cache, MAX_CACHE_SIZE / nshards);
+        Pthread_create(&tid, NULL, shard_routine, &shards[i]);
+    }
+    while (1)
+    {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        for (i = 0; i < nshards; i = i + 1)
+        {
+            printf("shard %d: accepted %lu, requests %lu, hits %lu, misses %lu, bytes %lu, timeouts %lu\n",
+                   i, shards[i].accepted, shards[i].requests, shards[i].hits, shards[i].misses, shards[i].bytes,
+                   shards[i].timeouts);
+            sprintf(name, "shard %d cache", i);
+            cache_stats(shards[i].cache, name);
+        }
+        dns_stats();
+    }
+}
 
 int parse_uri(char *uri, char *hostname, char *path, int *port)
 {
@@ -307,37 +4914,80 @@ static const char *conn_header = "Connection: close\r\n";
 static const char *prox_header = "Proxy-Connection: close\r\n";
 static const char *host_header_format = "Host: %s\r\n";
 static const char *requestlint_header_format = "GET %s HTTP/1.0\r\n";
+static const char *persistent_request_format = "GET %s HTTP/1.1\r\n";
+static const char *persistent_conn_header = "Connection: keep-alive\r\n";
 static const char *endof_header = "\r\n";
 static const char *connection_key = "Connection";
 static const char *user_agent_key = "User-Agent";
 static const char *proxy_connection_key = "Proxy-Connection";
 static const char *host_key = "Host";
 
-void makeHTTPheader(char *HTTPheader, char *hostname, char *path, int port, rio_t *client_rio)
+// dst의 len 위치에 fmt로 만든 문자열을 이어 붙이고 len을 늘림. 끝의 NUL까지 size 안에 들어가지 않으면
+// 붙이지 않고 -1을 리턴함
+static int header_append(char *dst, size_t *len, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(dst + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= size - *len)
+    {
+        dst[*len] = '\0';
+        return -1;
+    }
+    *len += n;
+    return 0;
+}
+
+// 클라이언트의 요청 헤더를 빈 줄까지 읽어 서버에 보낼 요청을 HTTPheader(MAXLINE 크기)에 만듦.
+// keepalive가 NULL이 아니면 클라이언트가 보낸 Connection/Proxy-Connection 헤더에 따라 연결 유지 여부를 갱신함.
+// persistent가 1이면 서버 연결을 풀에서 다시 쓸 수 있도록 HTTP/1.1 keep-alive 요청을 만들고, 0이면 HTTP/1.0 요청 뒤 서버가 연결을 닫게 함.
+// 성공하면 0, 요청이 HTTPheader에 들어가지 않으면 남은 헤더를 읽지 않고 -1, 클라이언트 연결에서 읽다 실패하면 -2를 리턴함
+int makeHTTPheader(char *HTTPheader, char *hostname, char *path, int port, rio_t *client_rio, int *keepalive, int persistent)
 {
-    char buf[MAXLINE], request_header[MAXLINE], other_header[MAXLINE], host_header[MAXLINE];
-    sprintf(request_header, requestlint_header_format, path);
-    while(Rio_readlineb(client_rio, buf, MAXLINE) > 0)
+    char buf[MAXLINE], other_header[MAXLINE], host_header[MAXLINE];
+    size_t len = 0, otherlen = 0;
+    ssize_t n;
+
+    other_header[0] = host_header[0] = '\0';
+    // 클라이언트 하나의 연결 오류로 프로세스가 끝나지 않도록 오류에도 종료하지 않는 rio_readlineb로 읽음
+    while ((n = rio_readlineb(client_rio, buf, MAXLINE)) > 0)
     {
-        if(strcmp(buf, endof_header) == 0)
+        if (strcmp(buf, endof_header) == 0)
         {
             break;
         }
-        if(!strncasecmp(buf, host_key, strlen(host_key)))
+        if (!strncasecmp(buf, host_key, strlen(host_key)))
         {
             strcpy(host_header, buf);
             continue;
         }
-        if(!strncasecmp(buf, connection_key, strlen(connection_key))
-                &&!strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key))
-                &&!strncasecmp(buf, user_agent_key, strlen(user_agent_key)))
+        if (!strncasecmp(buf, connection_key, strlen(connection_key))
+                || !strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key)))
         {
-            strcat(other_header, buf);
+            if (keepalive && strcasestr(buf, "close"))
+                *keepalive = 0;
+            else if (keepalive && strcasestr(buf, "keep-alive"))
+                *keepalive = 1;
+            continue;
         }
+        if (strncasecmp(buf, user_agent_key, strlen(user_agent_key))
+                && header_append(other_header, &otherlen, MAXLINE, "%s", buf) < 0)
+            return -1;
     }
-    if(strlen(host_header) == 0)
-    {
-        sprintf(host_header, host_header_format, hostname);
-    }
-    sprintf(HTTPheader, "%s%s%s%s%s%s%s", request_header, host_header, conn_header, prox_header, user_agent_header, other_header, endof_header);
-}
\ No newline at end of file
+    if (n < 0)
+        return -2;
+    if (header_append(HTTPheader, &len, MAXLINE, persistent ? persistent_request_format : requestlint_header_format, path) < 0)
+        return -1;
+    if (strlen(host_header) == 0 ? header_append(HTTPheader, &len, MAXLINE, host_header_format, hostname) < 0
+                                 : header_append(HTTPheader, &len, MAXLINE, "%s", host_header) < 0)
+        return -1;
+    if (persistent ? header_append(HTTPheader, &len, MAXLINE, "%s", persistent_conn_header) < 0
+                   : header_append(HTTPheader, &len, MAXLINE, "%s%s", conn_header, prox_header) < 0)
+        return -1;
+    if (header_append(HTTPheader, &len, MAXLINE, "%s%s%s", user_agent_header, other_header, endof_header) < 0)
+        return -1;
+    return 0;
+}
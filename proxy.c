@@ -41,7 +41,6 @@ void doit(int connfd)
     char HTTPheader[MAXLINE], hostname[MAXLINE], path[MAXLINE];
     rio_t rio;
     int EndServerfd;
-    rio_t serv_rio;
 
     // rio와 connfd를 연결
     Rio_readinitb(&rio, connfd);
@@ -75,18 +74,16 @@ void doit(int connfd)
         printf("connection failed\n");
         return;
     }
-    // 서버의 내부 버퍼를 초기화하고, EndServerfd와 연결함.
-    Rio_readinitb(&serv_rio, EndServerfd);
     // 서버에게 전달할 HTTPheader를 EndServerfd에 작성함.
     Rio_writen(EndServerfd, HTTPheader, strlen(HTTPheader));
     
-    // server가 작성란 respon
-    size_t n; // buf에 작성한 내용의 크기
-    while((n = Rio_readlineb(&serv_rio, buf, MAXLINE)) != 0)
-    {
-        printf("proxy received %d bytes, then send\n", n);
-        Rio_writen(connfd, buf, n); // client와 연결된 connfd에 server로부터 읽은 buf를 작성함.
-    }
+    // 이 프록시는 응답을 캐시하지 않으므로 한 줄씩 유저 공간으로 읽어올 필요가 없음.
+    // 서버 응답 전체를 splice로 커널 안에서 바로 connfd에 넘김.
+    ssize_t n; // 전달한 응답의 크기
+    if ((n = rio_splice(EndServerfd, connfd, -1)) < 0)
+        printf("relay failed: %s\n", strerror(errno));
+    else
+        printf("proxy relayed %ld bytes\n", (long)n);
     Close(EndServerfd); // clientfd close
 }
 